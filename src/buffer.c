@@ -0,0 +1,381 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+void lbuf_init(lbuf *b) {
+  b->data = NULL;
+  b->len = 0;
+  b->slots = 0;
+}
+
+void lbuf_free(lbuf *b) {
+  free(b->data);
+  lbuf_init(b);
+}
+
+// Makes room for at least n more bytes
+void lbuf_reserve(lbuf *b, size_t n) {
+  if (b->len + n <= b->slots) { return; }
+  while (b->len + n > b->slots) { b->slots = b->slots ? b->slots * 2 : 4096; }
+  b->data = realloc(b->data, b->slots);
+}
+
+void lbuf_put(lbuf *b, const void *p, size_t n) {
+  lbuf_reserve(b, n);
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+void lbuf_putc(lbuf *b, char c) {
+  lbuf_reserve(b, 1);
+  b->data[b->len++] = c;
+}
+
+void lbuf_puts(lbuf *b, const char *s) {
+  lbuf_put(b, s, strlen(s));
+}
+
+// "00" through "99", so integers are written two digits at a time
+static const char lbuf_digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// Writes the digits of u so that they end just before end, and returns
+// where they start
+static char* lbuf_format_ulong(char *end, unsigned long u) {
+  char *p = end;
+  while (u >= 100) {
+    const char *d = lbuf_digit_pairs + (u % 100) * 2;
+    u /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (u >= 10) {
+    *--p = lbuf_digit_pairs[u * 2 + 1];
+    *--p = lbuf_digit_pairs[u * 2];
+  } else {
+    *--p = '0' + u;
+  }
+  return p;
+}
+
+void lbuf_put_long(lbuf *b, long x) {
+  char tmp[24];
+
+  // Work on the magnitude as unsigned so LONG_MIN does not overflow
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  char *p = lbuf_format_ulong(tmp + sizeof(tmp), u);
+  if (x < 0) { *--p = '-'; }
+
+  lbuf_put(b, p, tmp + sizeof(tmp) - p);
+}
+
+// Doubles are converted with Ryu (Ulf Adams, PLDI 2018), which finds the
+// shortest decimal that reads back as the same double using 128 bit
+// multiplications by powers of five. The powers are kept to their top 125
+// bits, and the inverses are 2^(bits + 124) / 5^i rounded up. Rather than
+// carrying them as constants they are worked out once, on first use.
+#define LBUF_POW5_BITS 125
+#define LBUF_POW5_NUM 326
+#define LBUF_POW5_INV_NUM 342
+
+// Room for 5^341 with a bit to spare while dividing
+#define LBUF_BIG_WORDS 26
+
+typedef unsigned __int128 lbuf_u128;
+
+static uint64_t lbuf_pow5[LBUF_POW5_NUM][2];
+static uint64_t lbuf_pow5_inv[LBUF_POW5_INV_NUM][2];
+static pthread_once_t lbuf_pow5_once = PTHREAD_ONCE_INIT;
+
+static int lbuf_big_cmp(const uint32_t *x, const uint32_t *y) {
+  for (int i = LBUF_BIG_WORDS - 1; i >= 0; i--) {
+    if (x[i] != y[i]) { return x[i] < y[i] ? -1 : 1; }
+  }
+  return 0;
+}
+
+static void lbuf_big_sub(uint32_t *x, const uint32_t *y) {
+  uint64_t borrow = 0;
+  for (int i = 0; i < LBUF_BIG_WORDS; i++) {
+    uint64_t d = (uint64_t)x[i] - y[i] - borrow;
+    x[i] = (uint32_t)d;
+    borrow = (d >> 32) & 1;
+  }
+}
+
+static void lbuf_big_shl1(uint32_t *x) {
+  for (int i = LBUF_BIG_WORDS - 1; i > 0; i--) {
+    x[i] = (x[i] << 1) | (x[i - 1] >> 31);
+  }
+  x[0] <<= 1;
+}
+
+static void lbuf_pow5_init(void) {
+  uint32_t p[LBUF_BIG_WORDS] = { 1 }, r[LBUF_BIG_WORDS];
+  int len = 1;
+
+  for (int i = 0; i < LBUF_POW5_INV_NUM; i++) {
+    // The top bits of 5^i, moved up if it has fewer
+    if (i < LBUF_POW5_NUM) {
+      lbuf_u128 top = 0;
+      for (int bit = len - 1; bit >= 0 && bit >= len - LBUF_POW5_BITS; bit--) {
+        top = (top << 1) | ((p[bit / 32] >> (bit % 32)) & 1);
+      }
+      if (len < LBUF_POW5_BITS) { top <<= LBUF_POW5_BITS - len; }
+      lbuf_pow5[i][0] = (uint64_t)top;
+      lbuf_pow5[i][1] = (uint64_t)(top >> 64);
+    }
+
+    // 2^(len - 1 + bits) / 5^i, one quotient bit at a time
+    memset(r, 0, sizeof(r));
+    r[(len - 1) / 32] = 1u << ((len - 1) % 32);
+    lbuf_u128 q = 0;
+    for (int bit = 0; bit <= LBUF_POW5_BITS; bit++) {
+      if (bit) { lbuf_big_shl1(r); }
+      q <<= 1;
+      if (lbuf_big_cmp(r, p) >= 0) {
+        lbuf_big_sub(r, p);
+        q |= 1;
+      }
+    }
+    q += 1;
+    lbuf_pow5_inv[i][0] = (uint64_t)q;
+    lbuf_pow5_inv[i][1] = (uint64_t)(q >> 64);
+
+    // Next power
+    uint64_t carry = 0;
+    for (int w = 0; w < LBUF_BIG_WORDS; w++) {
+      uint64_t x = (uint64_t)p[w] * 5 + carry;
+      p[w] = (uint32_t)x;
+      carry = x >> 32;
+    }
+    int w = LBUF_BIG_WORDS - 1;
+    while (!p[w]) { w--; }
+    len = 32 * w;
+    for (uint32_t top = p[w]; top; top >>= 1) { len++; }
+  }
+}
+
+// ceil(log2(5^e)), floor(log10(2^e)) and floor(log10(5^e)) for the
+// exponents a double can have
+static int lbuf_pow5_bits(int e) { return (int)(((uint32_t)e * 1217359) >> 19) + 1; }
+static int lbuf_log10_pow2(int e) { return (int)(((uint32_t)e * 78913) >> 18); }
+static int lbuf_log10_pow5(int e) { return (int)(((uint32_t)e * 732923) >> 20); }
+
+static int lbuf_pow5_factor(uint64_t x) {
+  int n = 0;
+  while (x % 5 == 0) { x /= 5; n++; }
+  return n;
+}
+
+static uint64_t lbuf_mul_shift(uint64_t m, const uint64_t *mul, int j) {
+  lbuf_u128 lo = (lbuf_u128)m * mul[0];
+  lbuf_u128 hi = (lbuf_u128)m * mul[1];
+  return (uint64_t)(((lo >> 64) + hi) >> (j - 64));
+}
+
+// Finds the shortest decimal m * 10^e that reads back as the finite,
+// non-zero double with the given mantissa and exponent bits
+static void lbuf_shortest(uint64_t mantissa, int exponent, uint64_t *m, int *e) {
+  int e2;
+  uint64_t m2;
+  if (exponent == 0) {
+    e2 = 1 - 1023 - 52 - 2;
+    m2 = mantissa;
+  } else {
+    e2 = exponent - 1023 - 52 - 2;
+    m2 = (1ULL << 52) | mantissa;
+  }
+  int even = (m2 & 1) == 0;
+
+  // The double and the halfway points to its neighbours, times four. The
+  // lower neighbour is closer when the mantissa is a power of two.
+  uint64_t mv = 4 * m2;
+  int mm_shift = mantissa != 0 || exponent <= 1;
+
+  // Scale them by a power of ten so the interval has few enough digits
+  uint64_t vr, vp, vm;
+  int e10;
+  int vm_zeros = 0, vr_zeros = 0;
+  if (e2 >= 0) {
+    int q = lbuf_log10_pow2(e2) - (e2 > 3);
+    int k = LBUF_POW5_BITS + lbuf_pow5_bits(q) - 1;
+    int i = -e2 + q + k;
+    e10 = q;
+    vr = lbuf_mul_shift(4 * m2, lbuf_pow5_inv[q], i);
+    vp = lbuf_mul_shift(4 * m2 + 2, lbuf_pow5_inv[q], i);
+    vm = lbuf_mul_shift(4 * m2 - 1 - mm_shift, lbuf_pow5_inv[q], i);
+    if (q <= 21) {
+      // Only one of the three can be a multiple of 5, if any
+      if (mv % 5 == 0) {
+        vr_zeros = lbuf_pow5_factor(mv) >= q;
+      } else if (even) {
+        vm_zeros = lbuf_pow5_factor(mv - 1 - mm_shift) >= q;
+      } else {
+        vp -= lbuf_pow5_factor(mv + 2) >= q;
+      }
+    }
+  } else {
+    int q = lbuf_log10_pow5(-e2) - (-e2 > 1);
+    int i = -e2 - q;
+    int k = lbuf_pow5_bits(i) - LBUF_POW5_BITS;
+    int j = q - k;
+    e10 = q + e2;
+    vr = lbuf_mul_shift(4 * m2, lbuf_pow5[i], j);
+    vp = lbuf_mul_shift(4 * m2 + 2, lbuf_pow5[i], j);
+    vm = lbuf_mul_shift(4 * m2 - 1 - mm_shift, lbuf_pow5[i], j);
+    if (q <= 1) {
+      vr_zeros = 1;
+      if (even) {
+        vm_zeros = mm_shift == 1;
+      } else {
+        vp--;
+      }
+    } else if (q < 63) {
+      vr_zeros = (mv & ((1ULL << q) - 1)) == 0;
+    }
+  }
+
+  // Drop digits while the interval still holds a shorter decimal
+  int removed = 0, last = 0;
+  if (vm_zeros || vr_zeros) {
+    while (vp / 10 > vm / 10) {
+      vm_zeros &= vm % 10 == 0;
+      vr_zeros &= last == 0;
+      last = vr % 10;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    if (vm_zeros) {
+      while (vm % 10 == 0) {
+        vr_zeros &= last == 0;
+        last = vr % 10;
+        vr /= 10;
+        vp /= 10;
+        vm /= 10;
+        removed++;
+      }
+    }
+
+    // Exactly halfway rounds to even
+    if (vr_zeros && last == 5 && vr % 2 == 0) { last = 4; }
+    *m = vr + ((vr == vm && (!even || !vm_zeros)) || last >= 5);
+  } else {
+    int round_up = 0;
+    if (vp / 100 > vm / 100) {
+      round_up = vr % 100 >= 50;
+      vr /= 100;
+      vp /= 100;
+      vm /= 100;
+      removed += 2;
+    }
+    while (vp / 10 > vm / 10) {
+      round_up = vr % 10 >= 5;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    *m = vr + (vr == vm || round_up);
+  }
+  *e = e10 + removed;
+}
+
+// Writes the shortest decimal that reads back as exactly x, laid out the
+// way %.15g would, or %.16g or %.17g when it needs more digits
+void lbuf_put_double(lbuf *b, double x) {
+  // Integral values that %g would print without an exponent
+  if (x == (double)(long)x && x > -1e15 && x < 1e15
+      && (x != 0 || !signbit(x))) {
+    lbuf_put_long(b, (long)x);
+    return;
+  }
+
+  char tmp[40];
+  if (isnan(x) || isinf(x)) {
+    lbuf_put(b, tmp, snprintf(tmp, sizeof(tmp), "%g", x));
+    return;
+  }
+
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  uint64_t mantissa = bits & ((1ULL << 52) - 1);
+  int exponent = (int)((bits >> 52) & 0x7ff);
+
+  char *p = tmp;
+  if (bits >> 63) { *p++ = '-'; }
+  if (mantissa == 0 && exponent == 0) {
+    *p++ = '0';
+    lbuf_put(b, tmp, p - tmp);
+    return;
+  }
+
+  pthread_once(&lbuf_pow5_once, lbuf_pow5_init);
+  uint64_t m;
+  int e;
+  lbuf_shortest(mantissa, exponent, &m, &e);
+  while (m % 10 == 0) {
+    m /= 10;
+    e++;
+  }
+
+  char digits[24];
+  char *d = lbuf_format_ulong(digits + sizeof(digits), m);
+  int n = digits + sizeof(digits) - d;
+  int point = e + n - 1;
+
+  if (point < -4 || point >= (n > 15 ? n : 15)) {
+    // d.ddde+XX
+    *p++ = d[0];
+    if (n > 1) {
+      *p++ = '.';
+      memcpy(p, d + 1, n - 1);
+      p += n - 1;
+    }
+    *p++ = 'e';
+    *p++ = point < 0 ? '-' : '+';
+    int a = point < 0 ? -point : point;
+    if (a >= 100) { *p++ = '0' + a / 100; }
+    *p++ = '0' + a / 10 % 10;
+    *p++ = '0' + a % 10;
+  } else if (point < 0) {
+    // 0.000ddd
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -point - 1);
+    p += -point - 1;
+    memcpy(p, d, n);
+    p += n;
+  } else if (n <= point + 1) {
+    // ddd000
+    memcpy(p, d, n);
+    p += n;
+    memset(p, '0', point + 1 - n);
+    p += point + 1 - n;
+  } else {
+    // ddd.ddd
+    memcpy(p, d, point + 1);
+    p += point + 1;
+    *p++ = '.';
+    memcpy(p, d + point + 1, n - point - 1);
+    p += n - point - 1;
+  }
+
+  lbuf_put(b, tmp, p - tmp);
+}
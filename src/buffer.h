@@ -0,0 +1,32 @@
+#ifndef buffer_h
+#define buffer_h
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Growable byte buffer
+typedef struct {
+  char *data;
+  size_t len;
+  size_t slots;
+} lbuf;
+
+void lbuf_init(lbuf *b);
+void lbuf_free(lbuf *b);
+void lbuf_reserve(lbuf *b, size_t n);
+void lbuf_put(lbuf *b, const void *p, size_t n);
+void lbuf_putc(lbuf *b, char c);
+void lbuf_puts(lbuf *b, const char *s);
+
+// Number formatting
+void lbuf_put_long(lbuf *b, long x);
+void lbuf_put_double(lbuf *b, double x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
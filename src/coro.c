@@ -0,0 +1,373 @@
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "interp.h"
+
+// Usable stack of each coroutine, above a guard page. Only the pages a
+// coroutine actually touches are backed by memory.
+#define LCORO_STACK_SIZE (256 * 1024)
+
+// Stacks of finished coroutines kept for the next ones
+#define LCORO_STACK_CACHE 256
+
+enum { LCORO_READY, LCORO_PARKED, LCORO_SLEEPING, LCORO_DONE };
+
+typedef struct lcoro {
+  ucontext_t ctx;
+
+  // Context of the scheduler thread running it. A coroutine may be resumed
+  // by a different thread each time.
+  ucontext_t *sched;
+  char *stack;
+  int state;
+
+  // Lock held when the coroutine parked, released by the scheduler once
+  // the coroutine is off its stack so nobody can resume it before then
+  pthread_mutex_t *unlock;
+
+  // Monotonic deadline in nanoseconds while sleeping
+  long wake;
+
+  interp_t *interp;
+  lenv *env;
+  lval *expr;
+  struct lcoro *next;
+} lcoro;
+
+// Process wide like the thread pool. It only holds coroutines, each of
+// which knows its own interpreter.
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t done;
+  lcoro_queue ready;
+
+  // Min-heap of sleeping coroutines on wake
+  lcoro **sleepers;
+  int nsleepers;
+  int slots;
+
+  char *stacks[LCORO_STACK_CACHE];
+  int nstacks;
+} lsched;
+
+static pthread_once_t lsched_once = PTHREAD_ONCE_INIT;
+static __thread lcoro *lcoro_running;
+
+// Thread locals are read through a call so their address is never kept
+// across a switch, after which the coroutine may be on another thread
+static __attribute__((noinline)) lcoro* lcoro_self(void) {
+  return lcoro_running;
+}
+
+static long lsched_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void lcoro_queue_push(lcoro_queue *q, lcoro *co) {
+  co->next = NULL;
+  if (q->tail) { q->tail->next = co; } else { q->head = co; }
+  q->tail = co;
+}
+
+static lcoro* lcoro_queue_pop(lcoro_queue *q) {
+  lcoro *co = q->head;
+  if (co) {
+    q->head = co->next;
+    if (!q->head) { q->tail = NULL; }
+  }
+  return co;
+}
+
+static void lsched_sleepers_push(lcoro *co) {
+  if (lsched.nsleepers == lsched.slots) {
+    lsched.slots = lsched.slots ? lsched.slots * 2 : 64;
+    lsched.sleepers = realloc(lsched.sleepers, sizeof(lcoro*) * lsched.slots);
+  }
+  int i = lsched.nsleepers++;
+  while (i > 0 && lsched.sleepers[(i - 1) / 2]->wake > co->wake) {
+    lsched.sleepers[i] = lsched.sleepers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  lsched.sleepers[i] = co;
+}
+
+static lcoro* lsched_sleepers_pop(void) {
+  lcoro *top = lsched.sleepers[0];
+  lcoro *last = lsched.sleepers[--lsched.nsleepers];
+  int i = 0;
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= lsched.nsleepers) { break; }
+    if (c + 1 < lsched.nsleepers &&
+      lsched.sleepers[c + 1]->wake < lsched.sleepers[c]->wake) { c++; }
+    if (last->wake <= lsched.sleepers[c]->wake) { break; }
+    lsched.sleepers[i] = lsched.sleepers[c];
+    i = c;
+  }
+  lsched.sleepers[i] = last;
+  return top;
+}
+
+// Maps a stack with an inaccessible page below it, so running off the end
+// faults instead of overwriting another coroutine
+static char* lcoro_stack_new(void) {
+  pthread_mutex_lock(&lsched.lock);
+  char *s = lsched.nstacks ? lsched.stacks[--lsched.nstacks] : NULL;
+  pthread_mutex_unlock(&lsched.lock);
+  if (s) { return s; }
+
+  long page = sysconf(_SC_PAGESIZE);
+  s = mmap(NULL, LCORO_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (s == MAP_FAILED) { return NULL; }
+  mprotect(s, page, PROT_NONE);
+  return s;
+}
+
+// Called with lsched.lock held
+static void lcoro_stack_free(char *s) {
+  if (lsched.nstacks < LCORO_STACK_CACHE) {
+    lsched.stacks[lsched.nstacks++] = s;
+  } else {
+    munmap(s, LCORO_STACK_SIZE + sysconf(_SC_PAGESIZE));
+  }
+}
+
+// Goes back to the scheduler, returning when the coroutine is next resumed
+static void lcoro_switch(lcoro *co) {
+  swapcontext(&co->ctx, co->sched);
+}
+
+static void lcoro_main(void) {
+  lcoro *co = lcoro_self();
+  lval_del(lval_eval(co->env, co->expr));
+  co->expr = NULL;
+  lenv_unshare(co->env);
+  lenv_del(co->env);
+  co->env = NULL;
+  co->state = LCORO_DONE;
+  lcoro_switch(co);
+}
+
+static void lcoro_ready(lcoro *co) {
+  pthread_mutex_lock(&lsched.lock);
+  co->state = LCORO_READY;
+  lcoro_queue_push(&lsched.ready, co);
+  pthread_cond_signal(&lsched.cond);
+  pthread_mutex_unlock(&lsched.lock);
+}
+
+static void* lsched_worker(void *arg) {
+  ucontext_t self;
+
+  pthread_mutex_lock(&lsched.lock);
+  for (;;) {
+    long now = lsched_now();
+    while (lsched.nsleepers && lsched.sleepers[0]->wake <= now) {
+      lcoro_queue_push(&lsched.ready, lsched_sleepers_pop());
+    }
+
+    lcoro *co = lcoro_queue_pop(&lsched.ready);
+    if (!co) {
+      if (lsched.nsleepers) {
+        long wake = lsched.sleepers[0]->wake;
+        struct timespec ts = { wake / 1000000000L, wake % 1000000000L };
+        pthread_cond_timedwait(&lsched.cond, &lsched.lock, &ts);
+      } else {
+        pthread_cond_wait(&lsched.cond, &lsched.lock);
+      }
+      continue;
+    }
+    pthread_mutex_unlock(&lsched.lock);
+
+    co->sched = &self;
+    lcoro_running = co;
+    swapcontext(&self, &co->ctx);
+    lcoro_running = NULL;
+
+    // Once a parked coroutine's lock is released it can be woken and
+    // resumed elsewhere, so it is not touched after that
+    int state = co->state;
+    if (state == LCORO_PARKED) { pthread_mutex_unlock(co->unlock); }
+
+    pthread_mutex_lock(&lsched.lock);
+    if (state == LCORO_READY) {
+      lcoro_queue_push(&lsched.ready, co);
+    } else if (state == LCORO_SLEEPING) {
+      lsched_sleepers_push(co);
+      if (lsched.sleepers[0] == co) { pthread_cond_signal(&lsched.cond); }
+    } else if (state == LCORO_DONE) {
+      lcoro_stack_free(co->stack);
+      atomic_fetch_sub(&co->interp->coros, 1);
+      pthread_cond_broadcast(&lsched.done);
+      free(co);
+    }
+  }
+  return NULL;
+}
+
+// One scheduler thread per core unless LISPY_CORO_THREADS says otherwise.
+// They are detached and live until the process exits.
+static void lsched_start(void) {
+  pthread_mutex_init(&lsched.lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&lsched.cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&lsched.done, NULL);
+
+  const char *env = getenv("LISPY_CORO_THREADS");
+  long n = env ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) { n = 1; }
+  for (long i = 0; i < n; i++) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, lsched_worker, NULL) != 0) { break; }
+    pthread_detach(t);
+  }
+}
+
+int lval_go(lenv *e, lval *expr) {
+  pthread_once(&lsched_once, lsched_start);
+
+  char *stack = lcoro_stack_new();
+  if (!stack) {
+    lval_del(expr);
+    return -1;
+  }
+
+  lcoro *co = malloc(sizeof(lcoro));
+  co->stack = stack;
+  getcontext(&co->ctx);
+  co->ctx.uc_stack.ss_sp = co->stack + sysconf(_SC_PAGESIZE);
+  co->ctx.uc_stack.ss_size = LCORO_STACK_SIZE;
+  co->ctx.uc_link = NULL;
+  makecontext(&co->ctx, lcoro_main, 0);
+
+  co->interp = e->interp;
+  co->env = lenv_capture(e);
+  co->expr = expr;
+  co->expr->type = LVAL_SEXPR;
+
+  lenv_share(co->env);
+  atomic_fetch_add(&co->interp->coros, 1);
+  lcoro_ready(co);
+  return 0;
+}
+
+void lcoro_yield(void) {
+  lcoro *co = lcoro_self();
+  if (!co) {
+    sched_yield();
+    return;
+  }
+  co->state = LCORO_READY;
+  lcoro_switch(co);
+}
+
+void lcoro_sleep(long ms) {
+  if (ms < 0) { ms = 0; }
+  lcoro *co = lcoro_self();
+  if (!co) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+    return;
+  }
+  co->wake = lsched_now() + ms * 1000000L;
+  co->state = LCORO_SLEEPING;
+  lcoro_switch(co);
+}
+
+void lcoro_wait_all(interp_t *in) {
+  if (atomic_load(&in->coros) == 0) { return; }
+  pthread_mutex_lock(&lsched.lock);
+  while (atomic_load(&in->coros) > 0) {
+    pthread_cond_wait(&lsched.done, &lsched.lock);
+  }
+  pthread_mutex_unlock(&lsched.lock);
+}
+
+lval* lval_chan(int cap) {
+  lchan *c = malloc(sizeof(lchan));
+  atomic_init(&c->refs, 1);
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  c->buf = malloc(sizeof(lval*) * cap);
+  c->cap = cap;
+  c->head = 0;
+  c->count = 0;
+  c->senders.head = c->senders.tail = NULL;
+  c->receivers.head = c->receivers.tail = NULL;
+
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_CHAN;
+  v->chan = c;
+  return v;
+}
+
+void lchan_ref(lchan *c) {
+  atomic_fetch_add(&c->refs, 1);
+}
+
+void lchan_unref(lchan *c) {
+  if (atomic_fetch_sub(&c->refs, 1) != 1) { return; }
+  for (int i = 0; i < c->count; i++) {
+    lval_del(c->buf[(c->head + i) % c->cap]);
+  }
+  free(c->buf);
+  pthread_cond_destroy(&c->cond);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+// Waits for the channel to change, with c->lock held. A coroutine parks on
+// q and is resumed by lchan_notify, anything else blocks the thread.
+static void lchan_wait(lchan *c, lcoro_queue *q) {
+  lcoro *co = lcoro_self();
+  if (!co) {
+    pthread_cond_wait(&c->cond, &c->lock);
+    return;
+  }
+  lcoro_queue_push(q, co);
+  co->state = LCORO_PARKED;
+  co->unlock = &c->lock;
+  lcoro_switch(co);
+  pthread_mutex_lock(&c->lock);
+}
+
+// Wakes one coroutine parked on q and every blocked thread. They check the
+// channel again, so one that finds it taken just waits again.
+static void lchan_notify(lchan *c, lcoro_queue *q) {
+  lcoro *co = lcoro_queue_pop(q);
+  if (co) { lcoro_ready(co); }
+  pthread_cond_broadcast(&c->cond);
+}
+
+void lchan_send(lchan *c, lval *v) {
+  pthread_mutex_lock(&c->lock);
+  while (c->count == c->cap) { lchan_wait(c, &c->senders); }
+  c->buf[(c->head + c->count) % c->cap] = v;
+  c->count++;
+  lchan_notify(c, &c->receivers);
+  if (c->count < c->cap && c->senders.head) { lchan_notify(c, &c->senders); }
+  pthread_mutex_unlock(&c->lock);
+}
+
+lval* lchan_recv(lchan *c) {
+  pthread_mutex_lock(&c->lock);
+  while (c->count == 0) { lchan_wait(c, &c->receivers); }
+  lval *v = c->buf[c->head];
+  c->head = (c->head + 1) % c->cap;
+  c->count--;
+  lchan_notify(c, &c->senders);
+  if (c->count > 0 && c->receivers.head) { lchan_notify(c, &c->receivers); }
+  pthread_mutex_unlock(&c->lock);
+  return v;
+}
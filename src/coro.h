@@ -0,0 +1,61 @@
+#ifndef coro_h
+#define coro_h
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "parsing.h"
+
+struct lcoro;
+
+// Coroutines waiting on a channel, or ready to run, in arrival order
+typedef struct {
+  struct lcoro *head;
+  struct lcoro *tail;
+} lcoro_queue;
+
+// A bounded queue of values passed between coroutines, and between
+// coroutines and ordinary threads. Shared between every copy of the channel
+// lval and freed with the last.
+typedef struct lchan {
+  atomic_int refs;
+  pthread_mutex_t lock;
+
+  // Ring buffer of values sent but not yet received
+  lval **buf;
+  int cap;
+  int head;
+  int count;
+
+  // Coroutines parked on a full or empty channel
+  lcoro_queue senders;
+  lcoro_queue receivers;
+
+  // Threads outside any coroutine block here instead
+  pthread_cond_t cond;
+} lchan;
+
+// Starts evaluating expr as an S-Expression in a coroutine, for its side
+// effects only. Coroutines of every interpreter are multiplexed over a few
+// scheduler threads, LISPY_CORO_THREADS of them, one per core by default.
+// Returns -1 if no stack could be mapped for it.
+int lval_go(lenv *e, lval *expr);
+
+// Lets other coroutines run. Outside a coroutine these just give up the
+// thread or sleep it.
+void lcoro_yield(void);
+void lcoro_sleep(long ms);
+
+// Waits for every coroutine started under an interpreter to finish
+void lcoro_wait_all(interp_t *in);
+
+lval* lval_chan(int cap);
+void lchan_ref(lchan *c);
+void lchan_unref(lchan *c);
+
+// Send takes ownership of v. Both wait while the channel is full or empty,
+// parking the coroutine or blocking the thread.
+void lchan_send(lchan *c, lval *v);
+lval* lchan_recv(lchan *c);
+
+#endif
@@ -0,0 +1,72 @@
+#include "future.h"
+#include "interp.h"
+
+static void lfuture_eval(void *arg) {
+  lfuture *f = arg;
+  f->result = lval_eval(f->env, f->expr);
+  f->expr = NULL;
+  lenv_unshare(f->env);
+  lenv_del(f->env);
+  f->env = NULL;
+}
+
+void lfuture_ref(lfuture *f) {
+  atomic_fetch_add(&f->refs, 1);
+}
+
+void lfuture_unref(lfuture *f) {
+  if (atomic_fetch_sub(&f->refs, 1) != 1) { return; }
+  if (f->result) { lval_del(f->result); }
+  free(f);
+}
+
+static void lfuture_release(void *arg) {
+  lfuture_unref(arg);
+}
+
+// Starts evaluating expr as an S-Expression in a capture of e. The task
+// holds its own reference and drops it when done.
+static lfuture* lfuture_start(lenv *e, lval *expr, atomic_int *counter) {
+  lfuture *f = malloc(sizeof(lfuture));
+  atomic_init(&f->refs, 2);
+  atomic_init(&f->pending, 1);
+  f->env = lenv_capture(e);
+  f->expr = expr;
+  f->expr->type = LVAL_SEXPR;
+  f->result = NULL;
+
+  f->task.fn = lfuture_eval;
+  f->task.cleanup = lfuture_release;
+  f->task.arg = f;
+  f->task.counter = counter ? counter : &f->pending;
+
+  lenv_share(f->env);
+  lpool_submit(&f->task);
+  return f;
+}
+
+// Constructs a future for the value of expr
+lval* lval_future(lenv *e, lval *expr) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_FUTURE;
+  v->future = lfuture_start(e, expr, NULL);
+  return v;
+}
+
+// Evaluates expr in the background for its side effects only
+void lval_spawn(lenv *e, lval *expr) {
+  atomic_fetch_add(&e->interp->spawned, 1);
+  lfuture_unref(lfuture_start(e, expr, &e->interp->spawned));
+}
+
+// Waits for a future, running other tasks meanwhile, and returns a copy
+// of its value
+lval* lfuture_touch(lfuture *f) {
+  lpool_wait(&f->pending);
+  return lval_copy(f->result);
+}
+
+// Waits for every task spawned under an interpreter to finish
+void lfuture_wait_spawned(interp_t *in) {
+  lpool_wait(&in->spawned);
+}
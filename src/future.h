@@ -0,0 +1,25 @@
+#ifndef future_h
+#define future_h
+
+#include "parsing.h"
+#include "pool.h"
+
+// A Q-Expression being evaluated on the thread pool. Shared between every
+// copy of the future lval and the running task, and freed with the last.
+typedef struct lfuture {
+  atomic_int refs;
+  atomic_int pending;
+  ltask task;
+  lenv *env;
+  lval *expr;
+  lval *result;
+} lfuture;
+
+lval* lval_future(lenv *e, lval *expr);
+void lval_spawn(lenv *e, lval *expr);
+lval* lfuture_touch(lfuture *f);
+void lfuture_ref(lfuture *f);
+void lfuture_unref(lfuture *f);
+void lfuture_wait_spawned(interp_t *in);
+
+#endif
@@ -0,0 +1,51 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "serial.h"
+
+// An image is "LISPIMG3" followed by the serialized environment, see
+// serial.c for the encoding. Its header identifies the builtin table of the
+// build that wrote it, and images from a build with a different table are
+// not loaded.
+#define IMAGE_MAGIC "LISPIMG3"
+
+// Writes every binding of e to an image at path. Returns 0 on success.
+int image_save(lenv *e, const char *path) {
+  lbuf b;
+  lbuf_init(&b);
+  lbuf_put(&b, IMAGE_MAGIC, 8);
+  lenv_serialize(e, &b);
+
+  FILE *f = fopen(path, "wb");
+  int ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+  if (f && fclose(f) != 0) { ok = 0; }
+
+  lbuf_free(&b);
+  return ok ? 0 : 1;
+}
+
+// Maps the image at path and adds each of its bindings to e.
+// Returns 0 on success.
+int image_load(lenv *e, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { return 1; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 8) {
+    close(fd);
+    return 1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { return 1; }
+
+  int err = memcmp(map, IMAGE_MAGIC, 8) != 0
+    || lenv_deserialize(e, (const char*)map + 8, st.st_size - 8) != 0;
+
+  munmap(map, st.st_size);
+  return err;
+}
@@ -0,0 +1,11 @@
+#ifndef image_h
+#define image_h
+
+#include "parsing.h"
+
+// Images hold every binding of an environment so that a prelude can be
+// restored without parsing or evaluating it again
+int image_save(lenv *e, const char *path);
+int image_load(lenv *e, const char *path);
+
+#endif
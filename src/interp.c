@@ -0,0 +1,259 @@
+#include <sys/stat.h>
+
+#include "interp.h"
+#include "reader.h"
+#include "future.h"
+#include "coro.h"
+#include "image.h"
+#include "pool.h"
+
+// Creates an interpreter with every builtin defined
+interp_t* interp_new(void) {
+  interp_t *in = malloc(sizeof(interp_t));
+  in->env = lenv_new();
+  in->env->interp = in;
+  for (int i = 0; i < LENV_SLOTS; i++) {
+    atomic_init(&in->slots[i].readers, 0);
+  }
+  atomic_init(&in->writing, 0);
+  pthread_mutex_init(&in->write_lock, NULL);
+  atomic_init(&in->spawned, 0);
+  atomic_init(&in->coros, 0);
+  in->out = NULL;
+  in->exited = 0;
+  in->Lispy = NULL;
+
+  lenv_add_builtins(in->env);
+  return in;
+}
+
+// Waits for anything still running under the interpreter and frees it
+void interp_del(interp_t *in) {
+  lfuture_wait_spawned(in);
+  lcoro_wait_all(in);
+  lenv_del(in->env);
+  if (in->Lispy) {
+    mpc_cleanup(6, in->Number, in->Symbol, in->Sexpr, in->Qexpr, in->Expr,
+      in->Lispy);
+  }
+  pthread_mutex_destroy(&in->write_lock);
+  free(in);
+}
+
+void interp_def_builtin(interp_t *in, const char *name, lbuiltin func) {
+  lenv_add_builtin(in->env, (char*)name, func);
+}
+
+int interp_load_image(interp_t *in, const char *path) {
+  return image_load(in->env, path);
+}
+
+int interp_save_image(interp_t *in, const char *path) {
+  return image_save(in->env, path);
+}
+
+lval* interp_eval(interp_t *in, lval *form) {
+  lval *x = lval_eval(in->env, form);
+  if (x->type == LVAL_ERR && x->err == LERR_EXIT) { in->exited = 1; }
+  return x;
+}
+
+int interp_exited(interp_t *in) {
+  return in->exited;
+}
+
+lval* interp_eval_string(interp_t *in, const char *s, size_t len) {
+  lreader r;
+  lreader_init(&r, "<string>", s, len);
+
+  lval *x, *last = lval_sexpr();
+  while ((x = lreader_next(&r))) {
+    lval_del(last);
+    last = interp_eval(in, x);
+    if (last->type == LVAL_ERR) { break; }
+  }
+
+  lreader_free(&r);
+  return last;
+}
+
+// A run of batch expressions evaluated by one task
+typedef struct {
+  lenv *e;
+  lval **cells;
+  int lo;
+  int hi;
+} lbatch_chunk;
+
+static void lbatch_eval(void *arg) {
+  lbatch_chunk *c = arg;
+  for (int i = c->lo; i < c->hi; i++) {
+    c->cells[i] = lval_eval(c->e, c->cells[i]);
+  }
+}
+
+// Evaluates every expression in forms in place, across the thread pool
+static void lbatch_eval_parallel(interp_t *in, lval *forms) {
+  int chunks = lpool_size() * 4;
+  if (chunks > forms->count) { chunks = forms->count; }
+  if (chunks < 2) {
+    lbatch_chunk c = { in->env, forms->cell, 0, forms->count };
+    lbatch_eval(&c);
+    return;
+  }
+
+  lbatch_chunk *c = malloc(sizeof(lbatch_chunk) * chunks);
+  ltask *tasks = malloc(sizeof(ltask) * chunks);
+  for (int i = 0; i < chunks; i++) {
+    c[i].e = in->env;
+    c[i].cells = forms->cell;
+    c[i].lo = (int)((long)forms->count * i / chunks);
+    c[i].hi = (int)((long)forms->count * (i + 1) / chunks);
+    tasks[i].fn = lbatch_eval;
+    tasks[i].arg = &c[i];
+  }
+
+  lenv_share(in->env);
+  lpool_run(tasks, chunks);
+  lenv_unshare(in->env);
+
+  free(tasks);
+  free(c);
+}
+
+int interp_eval_batch(interp_t *in, const char *s, size_t len, int parallel,
+  lbuf *out) {
+  // One pass over the whole buffer reads every expression
+  lval *forms = lval_read_str("<batch>", s, len);
+  if (forms->type == LVAL_ERR) {
+    lval_write(out, forms);
+    lbuf_putc(out, '\n');
+    lval_del(forms);
+    return -1;
+  }
+
+  if (parallel) {
+    lbatch_eval_parallel(in, forms);
+  } else {
+    for (int i = 0; i < forms->count; i++) {
+      forms->cell[i] = lval_eval(in->env, forms->cell[i]);
+    }
+  }
+
+  // Results go out in input order, one per line
+  for (int i = 0; i < forms->count; i++) {
+    lval_write(out, forms->cell[i]);
+    lbuf_putc(out, '\n');
+  }
+
+  int n = forms->count;
+  lval_del(forms);
+  return n;
+}
+
+// Returns the lispy mpc grammar, building it the first time
+mpc_parser_t* interp_grammar(interp_t *in) {
+  if (!in->Lispy) {
+    in->Number = mpc_new("number");
+    in->Symbol = mpc_new("symbol");
+    in->Sexpr = mpc_new("sexpr");   // Symbolic Expression
+    in->Qexpr = mpc_new("qexpr");   // Quoted Expression (Macros)
+    in->Expr = mpc_new("expr");
+    in->Lispy = mpc_new("lispy");
+    lispy_grammar(in->Number, in->Symbol, in->Sexpr, in->Qexpr, in->Expr,
+      in->Lispy);
+  }
+  return in->Lispy;
+}
+
+void interp_write(interp_t *in, const char *s, size_t n) {
+  if (in && in->out) {
+    lbuf_put(in->out, s, n);
+  } else {
+    fwrite(s, 1, n, stdout);
+  }
+}
+
+// Writes a value and a new line to the interpreter's output
+void interp_println(interp_t *in, lval *v) {
+  if (in && in->out) {
+    lval_write(in->out, v);
+    lbuf_putc(in->out, '\n');
+  } else {
+    lval_println(v);
+  }
+}
+
+// Reads, evaluates and discards one top level expression at a time from a
+// file or pipe, printing each result as soon as it is ready. Memory use does
+// not grow with the size of the input. Stops at exit.
+void eval_stream(interp_t *in, const char *filename, FILE *f) {
+  lreader r;
+  lreader_init_file(&r, filename, f);
+
+  lval *x;
+  while ((x = lreader_next(&r))) {
+    x = interp_eval(in, x);
+    if (x->type == LVAL_ERR && x->err == LERR_EXIT) {
+      lval_del(x);
+      break;
+    }
+
+    // Skip the empty results of definitions
+    if (x->type != LVAL_SEXPR || x->count > 0) {
+      interp_println(in, x);
+      if (!in->out) { fflush(stdout); }
+    }
+    lval_del(x);
+  }
+
+  lreader_free(&r);
+}
+
+// Evaluates every top level expression in a buffer, printing each result,
+// until one calls exit
+void eval_buffer(interp_t *in, const char *filename, const char *s, size_t len) {
+  lreader r;
+  lreader_init(&r, filename, s, len);
+
+  lval *x;
+  while ((x = lreader_next(&r))) {
+    x = interp_eval(in, x);
+    if (x->type == LVAL_ERR && x->err == LERR_EXIT) {
+      lval_del(x);
+      break;
+    }
+    if (x->type != LVAL_SEXPR || x->count > 0) {
+      interp_println(in, x);
+    }
+    lval_del(x);
+  }
+
+  lreader_free(&r);
+}
+
+// Loads a whole script with a single read and evaluates it. Anything that
+// isn't a regular file, and '-' for stdin, is streamed instead.
+// Returns 0 on success.
+int eval_file(interp_t *in, const char *filename) {
+  FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+  if (!f) {
+    perror(filename);
+    return 1;
+  }
+
+  struct stat st;
+  if (f == stdin || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) {
+    eval_stream(in, filename, f);
+    if (f != stdin) { fclose(f); }
+    return 0;
+  }
+
+  char *s = malloc(st.st_size + 1);
+  size_t len = fread(s, 1, st.st_size, f);
+  fclose(f);
+
+  eval_buffer(in, filename, s, len);
+  free(s);
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef interp_h
+#define interp_h
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "libparsing.h"
+
+// Readers of the shared environments, one cache line each
+#define LENV_SLOTS 64
+typedef struct {
+  atomic_int readers;
+  char pad[64 - sizeof(atomic_int)];
+} lenv_slot;
+
+// Everything one interpreter owns. Interpreters share no mutable state, so
+// several can run at once on different threads of one process. Only the
+// thread pool is common to all of them, and it holds no interpreter state.
+struct interp {
+  // Global environment, every environment evaluated under it points back
+  // here through its interp field
+  lenv *env;
+
+  // Guards the environments marked by lenv_share. Readers count themselves
+  // in the slot of their thread, writers hold write_lock and set writing
+  // until every slot is empty.
+  lenv_slot slots[LENV_SLOTS];
+  atomic_int writing;
+  pthread_mutex_t write_lock;
+
+  // Tasks started by spawn that have not finished yet
+  atomic_int spawned;
+
+  // Coroutines started by go that have not finished yet
+  atomic_int coros;
+
+  // Where results and print go, stdout when NULL
+  lbuf *out;
+
+  // Set once a top level expression called exit
+  int exited;
+
+  // The mpc grammar, only built when asked for
+  mpc_parser_t *Number;
+  mpc_parser_t *Symbol;
+  mpc_parser_t *Sexpr;
+  mpc_parser_t *Qexpr;
+  mpc_parser_t *Expr;
+  mpc_parser_t *Lispy;
+};
+
+// The rest of the interpreter API is in libparsing.h
+void interp_write(interp_t *in, const char *s, size_t n);
+
+#endif
@@ -0,0 +1,217 @@
+#include "lexer.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Character classes
+enum {
+  LCH_SPACE  = 1,
+  LCH_SYMBOL = 2,
+  LCH_DIGIT  = 4,
+  LCH_DELIM  = 8
+};
+
+// Class of every byte. Symbol characters match the symbol regex in the
+// grammar, whitespace matches mpc_whitespace.
+static const unsigned char llex_class[256] = {
+  [' '] = LCH_SPACE, ['\f'] = LCH_SPACE, ['\n'] = LCH_SPACE,
+  ['\r'] = LCH_SPACE, ['\t'] = LCH_SPACE, ['\v'] = LCH_SPACE,
+
+  ['('] = LCH_DELIM, [')'] = LCH_DELIM, ['{'] = LCH_DELIM, ['}'] = LCH_DELIM,
+
+  ['0' ... '9'] = LCH_SYMBOL | LCH_DIGIT,
+  ['a' ... 'z'] = LCH_SYMBOL,
+  ['A' ... 'Z'] = LCH_SYMBOL,
+  ['_'] = LCH_SYMBOL, ['+'] = LCH_SYMBOL, ['-'] = LCH_SYMBOL,
+  ['*'] = LCH_SYMBOL, ['/'] = LCH_SYMBOL, ['\\'] = LCH_SYMBOL,
+  ['='] = LCH_SYMBOL, ['<'] = LCH_SYMBOL, ['>'] = LCH_SYMBOL,
+  ['!'] = LCH_SYMBOL, ['&'] = LCH_SYMBOL
+};
+
+// Token type of each delimiter
+static const unsigned char llex_delim[256] = {
+  ['('] = LTOK_OPEN_SEXPR, [')'] = LTOK_CLOSE_SEXPR,
+  ['{'] = LTOK_OPEN_QEXPR, ['}'] = LTOK_CLOSE_QEXPR
+};
+
+#define LCH_IS(c, cls) (llex_class[(unsigned char)(c)] & (cls))
+
+// Builds the structural index of up to 64 bytes one byte at a time.
+// Used for the tail of the input and when no vector unit is available.
+static void llex_classify_scalar(const char *p, size_t n, lblock *b) {
+  b->space = b->delim = b->symbol = b->digit = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = llex_class[(unsigned char)p[i]];
+    uint64_t bit = (uint64_t)1 << i;
+    if (c & LCH_SPACE)  { b->space |= bit; }
+    if (c & LCH_DELIM)  { b->delim |= bit; }
+    if (c & LCH_SYMBOL) { b->symbol |= bit; }
+    if (c & LCH_DIGIT)  { b->digit |= bit; }
+  }
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+#if defined(__AVX2__)
+#define LVEC_WIDTH 32
+typedef __m256i lvec;
+#define lvec_load(p)    _mm256_loadu_si256((const __m256i*)(p))
+#define lvec_set(c)     _mm256_set1_epi8(c)
+#define lvec_eq(x, y)   _mm256_cmpeq_epi8(x, y)
+#define lvec_gt(x, y)   _mm256_cmpgt_epi8(x, y)
+#define lvec_or(x, y)   _mm256_or_si256(x, y)
+#define lvec_and(x, y)  _mm256_and_si256(x, y)
+#define lvec_mask(x)    ((uint64_t)(uint32_t)_mm256_movemask_epi8(x))
+#else
+#define LVEC_WIDTH 16
+typedef __m128i lvec;
+#define lvec_load(p)    _mm_loadu_si128((const __m128i*)(p))
+#define lvec_set(c)     _mm_set1_epi8(c)
+#define lvec_eq(x, y)   _mm_cmpeq_epi8(x, y)
+#define lvec_gt(x, y)   _mm_cmpgt_epi8(x, y)
+#define lvec_or(x, y)   _mm_or_si128(x, y)
+#define lvec_and(x, y)  _mm_and_si128(x, y)
+#define lvec_mask(x)    ((uint64_t)(uint16_t)_mm_movemask_epi8(x))
+#endif
+
+// Bytes of x in the range [lo, hi]. Comparisons are signed, so bytes above
+// 0x7f never fall in a range.
+#define lvec_in(x, lo, hi) \
+  lvec_and(lvec_gt(x, lvec_set((lo) - 1)), lvec_gt(lvec_set((hi) + 1), x))
+
+#define lvec_is(x, c) lvec_eq(x, lvec_set(c))
+
+// Builds the structural index of a full 64 byte block, a vector at a time
+static void llex_classify_block(const char *p, lblock *b) {
+  b->space = b->delim = b->symbol = b->digit = 0;
+
+  for (int i = 0; i < 64; i += LVEC_WIDTH) {
+    lvec x = lvec_load(p + i);
+
+    lvec space = lvec_or(lvec_is(x, ' '), lvec_in(x, '\t', '\r'));
+    lvec delim = lvec_or(lvec_or(lvec_is(x, '('), lvec_is(x, ')')),
+                         lvec_or(lvec_is(x, '{'), lvec_is(x, '}')));
+    lvec digit = lvec_in(x, '0', '9');
+
+    lvec alpha = lvec_or(lvec_in(x, 'a', 'z'), lvec_in(x, 'A', 'Z'));
+    lvec punct = lvec_or(
+      lvec_or(lvec_or(lvec_is(x, '_'), lvec_is(x, '+')),
+              lvec_or(lvec_is(x, '-'), lvec_is(x, '*'))),
+      lvec_or(lvec_or(lvec_is(x, '/'), lvec_is(x, '\\')),
+              lvec_or(lvec_is(x, '!'), lvec_is(x, '&'))));
+    punct = lvec_or(punct, lvec_in(x, '<', '>'));
+
+    b->space  |= lvec_mask(space) << i;
+    b->delim  |= lvec_mask(delim) << i;
+    b->digit  |= lvec_mask(digit) << i;
+    b->symbol |= lvec_mask(lvec_or(lvec_or(alpha, punct), digit)) << i;
+  }
+}
+
+#else
+
+static void llex_classify_block(const char *p, lblock *b) {
+  llex_classify_scalar(p, 64, b);
+}
+
+#endif
+
+// Returns the index of the block holding pos, building it if needed
+static inline lblock* llex_block_at(llexer *l, size_t pos) {
+  size_t start = pos & ~(size_t)63;
+  if (start != l->block_pos) {
+    if (start + 64 <= l->len) {
+      llex_classify_block(l->s + start, &l->block);
+    } else {
+      llex_classify_scalar(l->s + start, l->len - start, &l->block);
+    }
+    l->block_pos = start;
+  }
+  return &l->block;
+}
+
+// Selects one of the masks of a block
+enum {
+  LMASK_SPACE,
+  LMASK_SYMBOL,
+  LMASK_DIGIT
+};
+
+// Returns the first position at or after pos whose byte is not in the given
+// class, jumping over whole runs using the structural index.
+static inline size_t llex_skip(llexer *l, size_t pos, int mask) {
+  while (pos < l->len) {
+    lblock *b = llex_block_at(l, pos);
+    uint64_t m =
+      mask == LMASK_SPACE  ? b->space  :
+      mask == LMASK_SYMBOL ? b->symbol : b->digit;
+
+    // Bits past the end of the input are clear so always end a run
+    m = ~m >> (pos & 63);
+    if (m) { return pos + __builtin_ctzll(m); }
+    pos = (pos & ~(size_t)63) + 64;
+  }
+  return l->len;
+}
+
+void llexer_init(llexer *l, const char *s, size_t len) {
+  l->s = s;
+  l->len = len;
+  l->pos = 0;
+  l->block_pos = (size_t)-1;
+  l->count = 0;
+  l->next = 0;
+}
+
+// Lexes up to LLEX_BATCH tokens from the current position.
+// Returns the number of tokens lexed, 0 at the end of the input.
+int llex_fill(llexer *l) {
+  const char *s = l->s;
+  size_t len = l->len;
+  size_t pos = l->pos;
+  int n = 0;
+
+  while (n < LLEX_BATCH) {
+    pos = llex_skip(l, pos, LMASK_SPACE);
+    if (pos >= len) { break; }
+
+    ltoken *t = &l->toks[n++];
+    char c = s[pos];
+    t->pos = pos;
+
+    if (LCH_IS(c, LCH_DELIM)) {
+      t->type = llex_delim[(unsigned char)c];
+      pos++;
+    } else if (LCH_IS(c, LCH_DIGIT)
+      || (c == '-' && pos + 1 < len && LCH_IS(s[pos+1], LCH_DIGIT))) {
+      // Number, /-?[0-9]+(\.[0-9]+)?/
+      pos = llex_skip(l, pos + 1, LMASK_DIGIT);
+      if (pos + 1 < len && s[pos] == '.' && LCH_IS(s[pos+1], LCH_DIGIT)) {
+        pos = llex_skip(l, pos + 2, LMASK_DIGIT);
+      }
+      t->type = LTOK_NUMBER;
+    } else if (LCH_IS(c, LCH_SYMBOL)) {
+      pos = llex_skip(l, pos + 1, LMASK_SYMBOL);
+      t->type = LTOK_SYMBOL;
+    } else {
+      // Anything else is a single bad character for the reader to report
+      pos++;
+      t->type = LTOK_BAD;
+    }
+    t->len = pos - t->pos;
+  }
+
+  l->pos = pos;
+  l->count = n;
+  l->next = 0;
+  return n;
+}
+
+// Returns the next token, or NULL at the end of the input
+ltoken* llex_next(llexer *l) {
+  if (l->next == l->count && !llex_fill(l)) { return NULL; }
+  return &l->toks[l->next++];
+}
@@ -0,0 +1,56 @@
+#ifndef lexer_h
+#define lexer_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Token types
+enum {
+  LTOK_END,
+  LTOK_OPEN_SEXPR,
+  LTOK_CLOSE_SEXPR,
+  LTOK_OPEN_QEXPR,
+  LTOK_CLOSE_QEXPR,
+  LTOK_NUMBER,
+  LTOK_SYMBOL,
+  LTOK_BAD
+};
+
+// Number of tokens lexed at a time
+#define LLEX_BATCH 1024
+
+// A token is a slice of the input buffer
+typedef struct {
+  int type;
+  size_t pos;
+  size_t len;
+} ltoken;
+
+// Structural index of a 64 byte block of input, one bit per byte
+typedef struct {
+  uint64_t space;
+  uint64_t delim;
+  uint64_t symbol;
+  uint64_t digit;
+} lblock;
+
+// Splits a buffer into tokens a batch at a time
+typedef struct {
+  const char *s;
+  size_t len;
+  size_t pos;
+
+  // Index of the block currently being lexed
+  size_t block_pos;
+  lblock block;
+
+  int count;
+  int next;
+  ltoken toks[LLEX_BATCH];
+} llexer;
+
+void llexer_init(llexer *l, const char *s, size_t len);
+int llex_fill(llexer *l);
+ltoken* llex_next(llexer *l);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef libparsing_h
+#define libparsing_h
+
+#include <stdio.h>
+
+#include "parsing.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Embedding API for libparsing. Interpreters are opaque, everything else is
+// plain lvals from parsing.h. Results belong to the caller, who frees them
+// with lval_del.
+
+interp_t* interp_new(void);
+void interp_del(interp_t *in);
+
+// Makes a native function available to Lisp code under name
+void interp_def_builtin(interp_t *in, const char *name, lbuiltin func);
+
+// Images saved with save-image or --save-image
+int interp_load_image(interp_t *in, const char *path);
+int interp_save_image(interp_t *in, const char *path);
+
+// Parses every top level expression of a buffer into one S-Expression, or
+// returns a parse error
+lval* lval_read_str(const char *filename, const char *s, size_t len);
+
+// Evaluates a form, taking ownership of it
+lval* interp_eval(interp_t *in, lval *form);
+
+// Non-zero once a top level expression called exit. exit never ends the
+// process by itself: evaluation stops with an error, the eval_ functions
+// below stop reading, and what else to end is up to the caller.
+int interp_exited(interp_t *in);
+
+// Evaluates each top level expression of a buffer in turn and returns the
+// value of the last one, or the first error
+lval* interp_eval_string(interp_t *in, const char *s, size_t len);
+
+// Evaluates every top level expression of a buffer and appends each result
+// to out on its own line, in input order, including empty ones. The buffer
+// is read in a single pass first. With parallel set the expressions are
+// spread over the thread pool, so they must not depend on each other.
+// Returns the number of expressions, or -1 after writing a parse error.
+int interp_eval_batch(interp_t *in, const char *s, size_t len, int parallel,
+  lbuf *out);
+
+// Evaluates and prints every top level expression, like the command line
+void eval_stream(interp_t *in, const char *filename, FILE *f);
+void eval_buffer(interp_t *in, const char *filename, const char *s, size_t len);
+int eval_file(interp_t *in, const char *filename);
+void interp_println(interp_t *in, lval *v);
+
+// The mpc grammar for the lispy language, built on first use
+mpc_parser_t* interp_grammar(interp_t *in);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <editline/readline.h>
+#include "libparsing.h"
+#include "server.h"
+
+// Command line client of libparsing: runs scripts and expressions given as
+// arguments, or the REPL when there are none. With --serve, whatever the
+// other arguments defined is the prelude of every connection.
+int main(int argc, char** argv) {
+
+  interp_t *in = interp_new();
+
+  // The mpc grammar is kept as an alternative to the direct reader, and an
+  // image can be loaded before anything else runs
+  int use_mpc = 0, batch = 0, status = 0, workers = 0;
+  const char *serve = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--mpc") == 0) {
+      use_mpc = 1;
+    } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      i++;
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serve = argv[++i];
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      workers = atoi(argv[++i]);
+    } else {
+      batch = 1;
+    }
+  }
+
+  // Fully buffer output in batch mode, it's flushed on exit
+  if (batch) {
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--mpc") == 0) {
+      continue;
+    } else if ((strcmp(argv[i], "--serve") == 0
+        || strcmp(argv[i], "--workers") == 0) && i + 1 < argc) {
+      i++;
+    } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      i++;
+      if (interp_load_image(in, argv[i]) != 0) {
+        fprintf(stderr, "%s: could not load image\n", argv[i]);
+        status = 1;
+      }
+    } else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) {
+      i++;
+      if (interp_save_image(in, argv[i]) != 0) {
+        perror(argv[i]);
+        status = 1;
+      }
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      i++;
+      eval_buffer(in, "<expr>", argv[i], strlen(argv[i]));
+    } else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+      // Stream even regular files, for inputs too large to load at once
+      i++;
+      FILE *f = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb");
+      if (!f) {
+        perror(argv[i]);
+        status = 1;
+        continue;
+      }
+      eval_stream(in, argv[i], f);
+      if (f != stdin) { fclose(f); }
+    } else if (eval_file(in, argv[i]) != 0) {
+      status = 1;
+    }
+
+    // exit ends the process from the command line, skipping the rest
+    if (interp_exited(in)) {
+      interp_del(in);
+      return 2;
+    }
+  }
+
+  if (serve) {
+    fflush(stdout);
+    if (workers < 1) { workers = sysconf(_SC_NPROCESSORS_ONLN); }
+    if (interp_serve(in, serve, workers) != 0) {
+      perror(serve);
+    }
+    return 1;
+  }
+
+  // Batch mode, scripts and expressions have been run without the REPL.
+  // Anything spawned still sees the environment until it finishes.
+  if (batch) {
+    interp_del(in);
+    return status;
+  }
+
+  // Only build the mpc grammar when it is going to be used
+  mpc_parser_t *Lispy = use_mpc ? interp_grammar(in) : NULL;
+
+  printf("Lisp version 0.0.0.1\n");
+  printf("Type Ctrl-C or 'exit' to exit\n");
+
+  while(1) {
+    char *input = readline("Lisp> ");
+
+    lval *x;
+    if (use_mpc) {
+      mpc_result_t r;
+      if (!mpc_parse("<stdin>", input, Lispy, &r)) {
+        // Print the error and move on to the next line
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        add_history(input);
+        free(input);
+        continue;
+      }
+      x = lval_read(r.output);
+      mpc_ast_delete(r.output);
+    } else {
+      x = lval_read_str("<stdin>", input, strlen(input));
+    }
+
+    // Print the result of the evaluation
+    x = interp_eval(in, x);
+    if (interp_exited(in)) {
+      lval_del(x);
+      free(input);
+      break;
+    }
+    interp_println(in, x);
+    lval_del(x);
+
+    add_history(input);
+    free(input);
+  }
+
+  interp_del(in);
+  return 2;
+}
@@ -1,5 +1,12 @@
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /*
 ** State Type
 */
@@ -41,20 +48,29 @@ static mpc_state_t mpc_state_new(void) {
 ** by seeking in the file at different positions.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
-**
-** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** one. As we assume pipes cannot be seeked the
+** input is read into a ring buffer as it is
+** needed. Data stays in the buffer as long as a
+** mark still refers to it, so if we are requested
+** to seek back we can simply read from the buffer
+** again. Anything before the oldest mark (or the
+** current position when nothing is marked) is
+** released as more input is read. Input is read
+** in large blocks, so the parse usually reads
+** past where it ends. `mpc_parse_pipe` drops that
+** input along with the buffer, while
+** `mpc_parse_pipe_rest` hands it to the caller.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** Where possible `mpc_parse_file` avoids the
+** File mode altogether. Regular files are
+** memory mapped and scanned as a String
+** without being copied, and files that cannot
+** be seeked are read as a Pipe.
+**
 */
 
 enum {
@@ -71,10 +87,35 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_PIPE_BLOCK = 65536
+};
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+/*
+** Results of memoised parsers, keyed by the
+** parser, the position it started at and
+** whether errors were suppressed or
+** backtracking disabled at the time. The end
+** state is kept so a hit can skip straight
+** past the input the parser consumed.
+*/
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  char flags;
+  char ok;
+  char last;
+  mpc_state_t state;
+  mpc_val_t *output;
+  mpc_err_t *error;
+  mpc_err_t *merged;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
@@ -84,6 +125,12 @@ typedef struct {
   char *string;
   char *buffer;
   FILE *file;
+  size_t mapped;
+
+  size_t buffer_slots;
+  long buffer_lo;
+  long buffer_hi;
+  int buffer_eof;
 
   int suppress;
   int backtrack;
@@ -94,6 +141,10 @@ typedef struct {
   char *lasts;
   char last;
 
+  mpc_memo_t *memo;
+  size_t memo_num;
+  size_t memo_slots;
+
   size_t mem_index;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
@@ -114,6 +165,11 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
+  i->mapped = 0;
+  i->buffer_slots = 0;
+  i->buffer_lo = 0;
+  i->buffer_hi = 0;
+  i->buffer_eof = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -123,6 +179,10 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_slots = 0;
+
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
@@ -144,6 +204,11 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->string[length] = '\0';
   i->buffer = NULL;
   i->file = NULL;
+  i->mapped = 0;
+  i->buffer_slots = 0;
+  i->buffer_lo = 0;
+  i->buffer_hi = 0;
+  i->buffer_eof = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -153,6 +218,10 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_slots = 0;
+
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
@@ -173,6 +242,11 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = pipe;
+  i->mapped = 0;
+  i->buffer_slots = 0;
+  i->buffer_lo = 0;
+  i->buffer_hi = 0;
+  i->buffer_eof = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -182,6 +256,10 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_slots = 0;
+
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
@@ -201,6 +279,11 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = file;
+  i->mapped = 0;
+  i->buffer_slots = 0;
+  i->buffer_lo = 0;
+  i->buffer_hi = 0;
+  i->buffer_eof = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -210,15 +293,76 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_slots = 0;
+
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
 }
 
+#ifdef MPC_USE_MMAP
+
+/*
+** Maps the rest of a regular file into memory
+** and reads it as a String. The mapping is one
+** byte longer than the file and that byte is
+** always zero, so the contents are terminated
+** just like any other String input.
+*/
+
+static mpc_input_t *mpc_input_new_mapped(const char *filename, FILE *file) {
+
+  struct stat st;
+  long offset, page;
+  size_t start, length;
+  char *base;
+  mpc_input_t *i;
+
+  if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) { return NULL; }
+
+  offset = ftell(file);
+  if (offset < 0 || offset >= st.st_size) { return NULL; }
+
+  /* Mappings must start on a page boundary */
+  page = sysconf(_SC_PAGESIZE);
+  start = (size_t)offset - (size_t)offset % page;
+  length = (size_t)st.st_size - start;
+
+  /* Reserve zeroed memory for the file and terminator, then map the file over it */
+  base = mmap(NULL, length + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) { return NULL; }
+
+  if (mmap(base, length, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+           fileno(file), start) == MAP_FAILED) {
+    munmap(base, length + 1);
+    return NULL;
+  }
+
+  i = mpc_input_new_nstring(filename, "", 0);
+  free(i->string);
+  i->string = base + (offset - start);
+  i->mapped = length + 1;
+  return i;
+}
+
+#endif
+
+static void mpc_memo_clear(mpc_input_t *i);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
+  mpc_memo_clear(i);
+
+#ifdef MPC_USE_MMAP
+  if (i->mapped) {
+    munmap(i->string - ((size_t)i->string % sysconf(_SC_PAGESIZE)), i->mapped);
+    i->string = NULL;
+  }
+#endif
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
@@ -313,14 +457,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -335,14 +474,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -359,12 +490,74 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+/*
+** Reads the next block of a Pipe into the ring
+** buffer. First any data that no mark refers to
+** is dropped, then the buffer is grown if the
+** data still needed plus a block won't fit.
+*/
+
+static void mpc_input_buffer_fill(mpc_input_t *i) {
+
+  long keep = i->marks_num > 0 && i->backtrack > 0
+    ? i->marks[0].pos : i->state.pos;
+  size_t slots, off, n, got;
+  char *buffer;
+  long j;
+
+  if (keep > i->buffer_lo) { i->buffer_lo = keep; }
+
+  slots = i->buffer_slots ? i->buffer_slots : MPC_INPUT_PIPE_BLOCK;
+  while ((size_t)(i->buffer_hi - i->buffer_lo) + MPC_INPUT_PIPE_BLOCK > slots) {
+    slots *= 2;
+  }
+
+  if (slots != i->buffer_slots) {
+    buffer = malloc(slots);
+    for (j = i->buffer_lo; j < i->buffer_hi; j += n) {
+      off = j & (i->buffer_slots - 1);
+      n = i->buffer_slots - off;
+      if ((long)n > i->buffer_hi - j) { n = i->buffer_hi - j; }
+      if (n > slots - (j & (slots - 1))) { n = slots - (j & (slots - 1)); }
+      memcpy(buffer + (j & (slots - 1)), i->buffer + off, n);
+    }
+    free(i->buffer);
+    i->buffer = buffer;
+    i->buffer_slots = slots;
+  }
+
+  /* Read as much as fits contiguously, up to a block */
+  off = i->buffer_hi & (slots - 1);
+  n = slots - off < MPC_INPUT_PIPE_BLOCK ? slots - off : MPC_INPUT_PIPE_BLOCK;
+  got = fread(i->buffer + off, 1, n, i->file);
+  i->buffer_hi += got;
+  if (got == 0) { i->buffer_eof = 1; }
+}
+
+/*
+** Copies the input of a Pipe that was read into
+** the buffer but not consumed by the parse into
+** a new string of *len bytes, plus a terminator.
+*/
+
+static char *mpc_input_buffer_rest(mpc_input_t *i, size_t *len) {
+  char *rest;
+  size_t j;
+  *len = i->state.pos < i->buffer_hi ? (size_t)(i->buffer_hi - i->state.pos) : 0;
+  rest = malloc(*len + 1);
+  for (j = 0; j < *len; j++) {
+    rest[j] = i->buffer[(i->state.pos + j) & (i->buffer_slots - 1)];
+  }
+  rest[*len] = '\0';
+  return rest;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  while (i->state.pos >= i->buffer_hi) {
+    if (i->buffer_eof) { return '\0'; }
+    mpc_input_buffer_fill(i);
+  }
+  return i->buffer[i->state.pos & (i->buffer_slots - 1)];
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -375,17 +568,7 @@ static char mpc_input_getc(mpc_input_t *i) {
 
     case MPC_INPUT_STRING: return i->string[i->state.pos];
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -405,23 +588,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       fseek(i->file, -1, SEEK_CUR);
       return c;
 
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -437,16 +604,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
+    case MPC_INPUT_PIPE: { break; }
     default: { break; }
   }
   return 0;
@@ -454,13 +612,6 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -601,14 +752,16 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+/*
+** Writes the quoted character into buffer, which needs room for four
+** characters, unless it has a name. Keeps mpc_err_string reentrant.
+*/
+static const char *mpc_err_char_unescape(char c, char *buffer) {
 
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
 
   switch (c) {
     case '\a': return "bell";
@@ -621,8 +774,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
 
 }
@@ -633,6 +786,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int pos = 0;
   int max = 1023;
   char *buffer = calloc(1, 1024);
+  char received[4];
 
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -657,7 +811,8 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->received));
+  mpc_err_string_cat(buffer, &pos, &max, "%s",
+    mpc_err_char_unescape(x->received, received));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
@@ -871,11 +1026,65 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
 
 static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   mpc_err_t *errs[2];
+  if (x == NULL) { return y; }
+  if (y == NULL) { return x; }
   errs[0] = x;
   errs[1] = y;
   return mpc_err_or(i, errs, 2);
 }
 
+/*
+** Copies an error out of the input's memory
+** so it can be kept for as long as the input.
+*/
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->received = x->received;
+  return y;
+}
+
+/*
+** Makes an error at state `s` expecting the
+** same things as `x`.
+*/
+
+static mpc_err_t *mpc_err_expected(mpc_input_t *i, mpc_err_t *x, mpc_state_t s, char received) {
+  int j;
+  mpc_err_t *y;
+  if (i->suppress) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->filename = mpc_malloc(i, strlen(i->filename) + 1);
+  strcpy(y->filename, i->filename);
+  y->state = s;
+  y->expected_num = x->expected_num;
+  y->expected = mpc_malloc(i, sizeof(char*) * x->expected_num);
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  y->failure = NULL;
+  y->received = received;
+  return y;
+}
+
 /*
 ** Parser Type
 */
@@ -914,9 +1123,32 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_MEMO       = 29,
+  MPC_TYPE_DFA        = 30
 };
 
+/*
+** A regular expression compiled to a DFA. Bytes
+** are grouped into classes that every state
+** treats alike. For each state and class
+** `trans` gives the next state or -1, and
+** `errs` the index of the errors a failed
+** attempt at that point leaves, or -1.
+*/
+
+typedef struct {
+  int states;
+  int classes;
+  unsigned char cls[256];
+  char *accept;
+  int *trans;
+  int *errs;
+  int templates_num;
+  mpc_err_t **templates;
+} mpc_dfa_t;
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -932,8 +1164,10 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; int *first; int first_num; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_copy_t c; mpc_dtor_t d; } mpc_pdata_memo_t;
+typedef struct { mpc_parser_t *x; mpc_dfa_t *d; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -953,6 +1187,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -1032,283 +1268,673 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+/*
+** Memoisation
+**
+** Memoised parsers keep their result at each
+** position in a hash table on the input, so
+** however often backtracking comes back to a
+** rule at the same place it is parsed once.
+** Outputs are stored as copies made by the
+** parser's copy function and handed out as
+** further copies, as callers are free to
+** change or delete what they are given. Any
+** errors merged from failed alternatives
+** while the rule ran are kept too, so the
+** final error message is the same either way.
+*/
+
 enum {
-  MPC_PARSE_STACK_MIN = 4
+  MPC_MEMO_SLOTS_MIN = 256
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+static int mpc_memo_flags(mpc_input_t *i) {
+  return (i->suppress > 0) | ((i->backtrack > 0) << 1);
+}
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+static mpc_memo_t *mpc_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos, int flags) {
+  size_t mask = i->memo_slots - 1;
+  size_t j = ((size_t)p >> 4) * 31 + (size_t)pos * 2654435761u + (size_t)flags;
+  j = (j ^ (j >> 16)) & mask;
+  while (i->memo[j].p
+  && (i->memo[j].p != p || i->memo[j].pos != pos || i->memo[j].flags != flags)) {
+    j = (j + 1) & mask;
+  }
+  return &i->memo[j];
+}
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p) {
+  mpc_memo_t *m;
+  if (i->memo_num == 0) { return NULL; }
+  m = mpc_memo_slot(i, p, i->state.pos, mpc_memo_flags(i));
+  return m->p ? m : NULL;
+}
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+static void mpc_memo_free(mpc_memo_t *m) {
+  if (m->ok && m->output) { m->p->data.memo.d(m->output); }
+  if (m->error) { mpc_err_delete(m->error); }
+  if (m->merged) { mpc_err_delete(m->merged); }
+}
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+static void mpc_memo_clear(mpc_input_t *i) {
+  size_t j;
+  for (j = 0; j < i->memo_slots; j++) {
+    if (i->memo[j].p) { mpc_memo_free(&i->memo[j]); }
+  }
+  free(i->memo);
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_slots = 0;
+}
+
+static void mpc_memo_grow(mpc_input_t *i) {
+  size_t j, slots = i->memo_slots;
+  mpc_memo_t *memo = i->memo;
+  i->memo_slots = slots ? slots * 2 : MPC_MEMO_SLOTS_MIN;
+  i->memo = calloc(i->memo_slots, sizeof(mpc_memo_t));
+  for (j = 0; j < slots; j++) {
+    if (memo[j].p) {
+      *mpc_memo_slot(i, memo[j].p, memo[j].pos, memo[j].flags) = memo[j];
+    }
   }
+  free(memo);
+}
 
-  switch (p->type) {
+static void mpc_memo_store(mpc_input_t *i, mpc_parser_t *p, long pos, int ok, mpc_result_t *x, mpc_err_t *merged) {
 
-    /* Basic Parsers */
-
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
-
-    /* Other parsers */
-
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
-
-    /* Application Parsers */
-
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+  mpc_memo_t *m;
+  int flags = mpc_memo_flags(i);
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  if ((i->memo_num + 1) * 2 > i->memo_slots) { mpc_memo_grow(i); }
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  m = mpc_memo_slot(i, p, pos, flags);
+  if (m->p) { mpc_memo_free(m); } else { i->memo_num++; }
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  m->p = p;
+  m->pos = pos;
+  m->flags = flags;
+  m->ok = ok;
+  m->last = i->last;
+  m->state = i->state;
+  m->output = ok && x->output ? p->data.memo.c(x->output) : NULL;
+  m->error = ok ? NULL : mpc_err_copy(x->error);
+  m->merged = mpc_err_copy(merged);
+}
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+static int mpc_memo_hit(mpc_input_t *i, mpc_memo_t *m, mpc_result_t *x, mpc_err_t **e) {
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+  i->state = m->state;
+  i->last = m->last;
 
-    /* Optional Parsers */
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->state.pos, SEEK_SET);
+  }
 
-    /* TODO: Update Not Error Message */
+  *e = mpc_err_merge(i, *e, mpc_err_copy(m->merged));
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  if (m->ok) {
+    x->output = m->output ? m->p->data.memo.c(m->output) : NULL;
+  } else {
+    x->error = mpc_err_copy(m->error);
+  }
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  return m->ok;
+}
 
-    /* Repeat Parsers */
+/*
+** Prediction
+**
+** An `or` whose alternatives all start by
+** consuming a byte gets a table from
+** `mpc_optimise` listing, for each byte, the
+** alternatives that can start with it. Only
+** those are tried while they might succeed.
+** The others are sure to fail on the spot, so
+** their errors only matter if every
+** alternative fails, and then they are run
+** after all to collect them. The errors of
+** each alternative are kept apart and merged
+** in the original order, so messages are the
+** same as trying every alternative in turn.
+*/
 
-    case MPC_TYPE_MANY:
+static const int *mpc_or_candidates(mpc_input_t *i, mpc_parser_t *p) {
+  const int *alts;
+  if (p->data.or.first == NULL || i->backtrack < 1) { return NULL; }
+  alts = p->data.or.first + p->data.or.first[(unsigned char)mpc_input_peekc(i)];
+  return alts[0] == -1 ? NULL : alts;
+}
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+static int mpc_or_listed(const int *alts, int j) {
+  for (; *alts != -1; alts++) { if (*alts == j) { return 1; } }
+  return 0;
+}
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+static mpc_err_t *mpc_or_errors(mpc_input_t *i, mpc_parser_t *p, const int *alts, mpc_result_t *xs, mpc_err_t *e) {
+  int j, k = 0, l = 0;
+  while (alts[l] != -1) { l++; }
+  for (j = 0; j < p->data.or.n; j++) {
+    e = mpc_err_merge(i, e, mpc_or_listed(alts, j) ? xs[k++].error : xs[l++].error);
+  }
+  return e;
+}
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+/*
+** Compiled Regular Expressions
+**
+** A regex compiled by `mpc_re` is matched by
+** running its DFA over String input, keeping
+** the longest match. The errors the regex
+** combinators would have merged on the way
+** only matter at the furthest byte anything
+** failed on, so just that one error is made,
+** from the template for the state and class
+** there. With no match, or input that can't
+** be scanned in place, the combinators run
+** instead and give the usual error.
+*/
 
-    case MPC_TYPE_MANY1:
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  int j;
+  for (j = 0; j < d->templates_num; j++) { mpc_err_delete(d->templates[j]); }
+  free(d->templates);
+  free(d->accept);
+  free(d->trans);
+  free(d->errs);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *d) {
+  int j, n = d->states * d->classes;
+  mpc_dfa_t *c = malloc(sizeof(mpc_dfa_t));
+  memcpy(c, d, sizeof(mpc_dfa_t));
+  c->accept = malloc(d->states);
+  memcpy(c->accept, d->accept, d->states);
+  c->trans = malloc(sizeof(int) * n);
+  memcpy(c->trans, d->trans, sizeof(int) * n);
+  c->errs = malloc(sizeof(int) * n);
+  memcpy(c->errs, d->errs, sizeof(int) * n);
+  c->templates = malloc(sizeof(mpc_err_t*) * (d->templates_num + 1));
+  for (j = 0; j < d->templates_num; j++) { c->templates[j] = mpc_err_copy(d->templates[j]); }
+  return c;
+}
+
+static void mpc_dfa_advance(mpc_state_t *s, const char *c, long n) {
+  long j;
+  for (j = 0; j < n; j++) {
+    s->pos++;
+    s->col++;
+    if (c[j] == '\n') {
+      s->col = 0;
+      s->row++;
+    }
+  }
+}
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+/*
+** Gives the length of the longest match at the
+** start of `s`, or -1, and the furthest byte
+** anything failed on with its errors, if any.
+*/
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+static long mpc_dfa_scan(mpc_dfa_t *d, const char *s, long *fail, int *f) {
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+  long j = 0, end = -1;
+  int q = 0, k;
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  *fail = -1;
+  if (d->accept[0]) { end = 0; }
 
-    case MPC_TYPE_COUNT:
+  while (1) {
+    k = q * d->classes + d->cls[(unsigned char)s[j]];
+    if (d->errs[k] != -1) { *fail = j; *f = d->errs[k]; }
+    q = d->trans[k];
+    if (q == -1) { return end; }
+    j++;
+    if (d->accept[q]) { end = j; }
+  }
+}
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+static int mpc_dfa_match(mpc_input_t *i, mpc_dfa_t *d, mpc_result_t *x, mpc_err_t **e) {
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+  const char *s;
+  char *o;
+  long end, fail;
+  int f = 0;
+  mpc_state_t st;
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  if (i->type != MPC_INPUT_STRING || i->backtrack < 1) { return 0; }
 
-    /* Combinatory Parsers */
+  s = i->string + i->state.pos;
+  end = mpc_dfa_scan(d, s, &fail, &f);
+  if (end == -1) { return 0; }
 
-    case MPC_TYPE_OR:
+  if (fail != -1) {
+    st = i->state;
+    mpc_dfa_advance(&st, s, fail);
+    *e = mpc_err_merge(i, *e, mpc_err_expected(i, d->templates[f], st, s[fail]));
+  }
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+  o = mpc_malloc(i, end + 1);
+  memcpy(o, s, end);
+  o[end] = '\0';
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+  if (end > 0) { i->last = s[end-1]; }
+  mpc_dfa_advance(&i->state, s, end);
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        }
-      }
+  x->output = o;
+  return 1;
+}
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+/*
+** The parser runs as a state machine over an explicit stack rather than
+** recursing once per combinator, so the depth of the input is only limited
+** by memory. There is a frame for every combinator waiting on a child, and
+** the outputs a combinator has collected from its children so far are kept
+** on a second stack, from the frame's base upwards. Both start on the C
+** stack and move to the heap when they outgrow it.
+*/
 
-    case MPC_TYPE_AND:
+enum {
+  MPC_PARSE_STACK_MIN = 64
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  int j;
+  int base;
+  long pos;
+  mpc_err_t *e;
+  const int *alts;
+  int replay;
+} mpc_frame_t;
+
+typedef struct {
+  mpc_frame_t *frames;
+  int frames_num;
+  int frames_slots;
+  mpc_result_t *results;
+  int results_num;
+  int results_slots;
+  mpc_frame_t frames_stk[MPC_PARSE_STACK_MIN];
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+} mpc_stack_t;
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+static void *mpc_stack_grow(mpc_input_t *i, void *xs, void *stk, int *slots, size_t size) {
+  void *ys;
+  if (xs == stk) {
+    ys = mpc_malloc(i, size * *slots * 2);
+    memcpy(ys, xs, size * *slots);
+  } else {
+    ys = mpc_realloc(i, xs, size * *slots * 2);
+  }
+  *slots *= 2;
+  return ys;
+}
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+static void mpc_stack_push_frame(mpc_input_t *i, mpc_stack_t *s, mpc_parser_t *p) {
+  mpc_frame_t *f;
+  if (s->frames_num == s->frames_slots) {
+    s->frames = mpc_stack_grow(i, s->frames, s->frames_stk, &s->frames_slots, sizeof(mpc_frame_t));
+  }
+  f = &s->frames[s->frames_num++];
+  f->p = p;
+  f->j = 0;
+  f->base = s->results_num;
+  f->pos = i->state.pos;
+  f->alts = NULL;
+}
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        }
+static void mpc_stack_push_result(mpc_input_t *i, mpc_stack_t *s, mpc_result_t x) {
+  if (s->results_num == s->results_slots) {
+    s->results = mpc_stack_grow(i, s->results, s->results_stk, &s->results_slots, sizeof(mpc_result_t));
+  }
+  s->results[s->results_num++] = x;
+}
+
+#define MPC_SUCCESS(v) x.output = v; ok = 1; break
+#define MPC_FAILURE(v) x.error = v; ok = 0; break
+#define MPC_PRIMITIVE(c) ok = (c); if (!ok) { x.error = NULL; } break
+#define MPC_CALL(c) mpc_stack_push_frame(i, &s, p); p = c; continue
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  mpc_stack_t s;
+  mpc_frame_t *f;
+  mpc_val_t **xs;
+  mpc_result_t x;
+  mpc_memo_t *m;
+  const int *alts;
+  int ok = 0, k;
+
+  s.frames = s.frames_stk;
+  s.frames_num = 0;
+  s.frames_slots = MPC_PARSE_STACK_MIN;
+  s.results = s.results_stk;
+  s.results_num = 0;
+  s.results_slots = MPC_PARSE_STACK_MIN;
+
+  while (1) {
+
+    /*
+    ** Start p. Primitives finish straight away, anything else pushes a
+    ** frame and starts on its first child.
+    */
+
+    if (p) {
+
+      switch (p->type) {
+
+        /* Basic Parsers */
+
+        case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&x.output));
+        case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&x.output));
+        case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&x.output));
+        case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&x.output));
+        case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&x.output));
+        case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&x.output));
+        case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&x.output));
+        case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&x.output));
+        case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&x.output));
+        case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&x.output));
+
+        /* Other parsers */
+
+        case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+        case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+        case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+        case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+        case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+        case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+
+        /* Application Parsers */
+
+        case MPC_TYPE_APPLY:      MPC_CALL(p->data.apply.x);
+        case MPC_TYPE_APPLY_TO:   MPC_CALL(p->data.apply_to.x);
+        case MPC_TYPE_CHECK:      MPC_CALL(p->data.check.x);
+        case MPC_TYPE_CHECK_WITH: MPC_CALL(p->data.check_with.x);
+
+        case MPC_TYPE_EXPECT:
+          mpc_input_suppress_enable(i);
+          MPC_CALL(p->data.expect.x);
+
+        case MPC_TYPE_PREDICT:
+          mpc_input_backtrack_disable(i);
+          MPC_CALL(p->data.predict.x);
+
+        /* Optional Parsers */
+
+        case MPC_TYPE_NOT:
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_CALL(p->data.not.x);
+
+        case MPC_TYPE_MAYBE: MPC_CALL(p->data.not.x);
+
+        /* Repeat Parsers */
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+          MPC_CALL(p->data.repeat.x);
+
+        /* Combinatory Parsers */
+
+        case MPC_TYPE_OR:
+          if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+          alts = mpc_or_candidates(i, p);
+          if (alts == NULL) { MPC_CALL(p->data.or.xs[0]); }
+          mpc_stack_push_frame(i, &s, p);
+          f = &s.frames[s.frames_num-1];
+          f->alts = alts;
+          f->replay = 0;
+          f->e = *e;
+          *e = NULL;
+          p = p->data.or.xs[alts[0]];
+          continue;
+
+        case MPC_TYPE_AND:
+          if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+          mpc_input_mark(i);
+          MPC_CALL(p->data.and.xs[0]);
+
+        /* Memoised Parsers */
+
+        case MPC_TYPE_MEMO:
+          m = mpc_memo_find(i, p);
+          if (m) { ok = mpc_memo_hit(i, m, &x, e); break; }
+          mpc_stack_push_frame(i, &s, p);
+          s.frames[s.frames_num-1].e = *e;
+          *e = NULL;
+          p = p->data.memo.x;
+          continue;
+
+        /* Compiled Regular Expressions */
+
+        case MPC_TYPE_DFA:
+          if (mpc_dfa_match(i, p->data.dfa.d, &x, e)) { ok = 1; break; }
+          MPC_CALL(p->data.dfa.x);
+
+        /* End */
+
+        default:
+          MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
       }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    }
 
-    /* End */
+    /*
+    ** A parser has finished with x. Hand it to the combinator waiting on
+    ** it, which either starts its next child or finishes in turn.
+    */
 
-    default:
+    p = NULL;
+    if (s.frames_num == 0) { break; }
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
-  }
+    f = &s.frames[s.frames_num-1];
+    xs = (mpc_val_t**)(s.results + f->base);
 
-  return 0;
+    switch (f->p->type) {
 
-}
+      /* Application Parsers */
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+      case MPC_TYPE_APPLY:
+        if (ok) { x.output = mpc_parse_apply(i, f->p->data.apply.f, x.output); }
+        break;
+
+      case MPC_TYPE_APPLY_TO:
+        if (ok) { x.output = mpc_parse_apply_to(i, f->p->data.apply_to.f, x.output, f->p->data.apply_to.d); }
+        break;
+
+      case MPC_TYPE_CHECK:
+        if (ok && !f->p->data.check.f(&x.output)) {
+          mpc_parse_dtor(i, f->p->data.check.dx, x.output);
+          x.error = mpc_err_fail(i, f->p->data.check.e);
+          ok = 0;
+        }
+        break;
+
+      case MPC_TYPE_CHECK_WITH:
+        if (ok && !f->p->data.check_with.f(&x.output, f->p->data.check_with.d)) {
+          mpc_parse_dtor(i, f->p->data.check.dx, x.output);
+          x.error = mpc_err_fail(i, f->p->data.check_with.e);
+          ok = 0;
+        }
+        break;
+
+      case MPC_TYPE_EXPECT:
+        mpc_input_suppress_disable(i);
+        if (!ok) { x.error = mpc_err_new(i, f->p->data.expect.m); }
+        break;
+
+      case MPC_TYPE_PREDICT:
+        mpc_input_backtrack_enable(i);
+        break;
+
+      /* Optional Parsers */
+
+      /* TODO: Update Not Error Message */
+
+      case MPC_TYPE_NOT:
+        if (ok) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, f->p->data.not.dx, x.output);
+          x.error = mpc_err_new(i, "opposite");
+          ok = 0;
+        } else {
+          mpc_input_unmark(i);
+          mpc_input_suppress_disable(i);
+          x.output = f->p->data.not.lf();
+          ok = 1;
+        }
+        break;
+
+      case MPC_TYPE_MAYBE:
+        if (!ok) {
+          *e = mpc_err_merge(i, *e, x.error);
+          x.output = f->p->data.not.lf();
+          ok = 1;
+        }
+        break;
+
+      /* Repeat Parsers */
+
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+        if (ok) {
+          f->j++;
+          mpc_stack_push_result(i, &s, x);
+          p = f->p->data.repeat.x;
+          continue;
+        }
+        if (f->p->type == MPC_TYPE_MANY1 && f->j == 0) {
+          x.error = mpc_err_many1(i, x.error);
+        } else {
+          *e = mpc_err_merge(i, *e, x.error);
+          x.output = mpc_parse_fold(i, f->p->data.repeat.f, f->j, xs);
+          ok = 1;
+        }
+        s.results_num = f->base;
+        break;
+
+      case MPC_TYPE_COUNT:
+        if (ok) {
+          f->j++;
+          mpc_stack_push_result(i, &s, x);
+          if (f->j != f->p->data.repeat.n) {
+            p = f->p->data.repeat.x;
+            continue;
+          }
+          xs = (mpc_val_t**)(s.results + f->base);
+          x.output = mpc_parse_fold(i, f->p->data.repeat.f, f->j, xs);
+        } else if (f->j == f->p->data.repeat.n) {
+          x.output = mpc_parse_fold(i, f->p->data.repeat.f, f->j, xs);
+          ok = 1;
+        } else {
+          for (k = 0; k < f->j; k++) {
+            mpc_parse_dtor(i, f->p->data.repeat.dx, xs[k]);
+          }
+          x.error = mpc_err_count(i, x.error, f->p->data.repeat.n);
+        }
+        s.results_num = f->base;
+        break;
+
+      /* Combinatory Parsers */
+
+      case MPC_TYPE_OR:
+        if (f->alts == NULL) {
+          if (!ok) {
+            *e = mpc_err_merge(i, *e, x.error);
+            if (++f->j < f->p->data.or.n) {
+              p = f->p->data.or.xs[f->j];
+              continue;
+            }
+            x.error = NULL;
+          }
+          break;
+        }
+        if (ok) {
+          for (k = f->base; k < s.results_num; k++) {
+            f->e = mpc_err_merge(i, f->e, s.results[k].error);
+          }
+          *e = mpc_err_merge(i, f->e, *e);
+          s.results_num = f->base;
+          break;
+        }
+        x.error = mpc_err_merge(i, *e, x.error);
+        *e = NULL;
+        mpc_stack_push_result(i, &s, x);
+        if (!f->replay) {
+          if (f->alts[++f->j] != -1) {
+            p = f->p->data.or.xs[f->alts[f->j]];
+            continue;
+          }
+          f->replay = 1;
+          f->j = -1;
+        }
+        while (++f->j < f->p->data.or.n && mpc_or_listed(f->alts, f->j)) { }
+        if (f->j < f->p->data.or.n) {
+          p = f->p->data.or.xs[f->j];
+          continue;
+        }
+        *e = mpc_or_errors(i, f->p, f->alts, s.results + f->base, f->e);
+        x.error = NULL;
+        s.results_num = f->base;
+        break;
+
+      case MPC_TYPE_AND:
+        if (ok) {
+          f->j++;
+          mpc_stack_push_result(i, &s, x);
+          if (f->j < f->p->data.and.n) {
+            p = f->p->data.and.xs[f->j];
+            continue;
+          }
+          mpc_input_unmark(i);
+          xs = (mpc_val_t**)(s.results + f->base);
+          x.output = mpc_parse_fold(i, f->p->data.and.f, f->j, xs);
+        } else {
+          mpc_input_rewind(i);
+          for (k = 0; k < f->j; k++) {
+            mpc_parse_dtor(i, f->p->data.and.dxs[k], xs[k]);
+          }
+        }
+        s.results_num = f->base;
+        break;
+
+      /* Memoised Parsers */
+
+      case MPC_TYPE_MEMO:
+        if (ok) { x.output = mpc_export(i, x.output); }
+        mpc_memo_store(i, f->p, f->pos, ok, &x, *e);
+        *e = mpc_err_merge(i, f->e, *e);
+        break;
+
+      default:
+        break;
+    }
+
+    s.frames_num--;
+  }
+
+  if (s.frames != s.frames_stk) { mpc_free(i, s.frames); }
+  if (s.results != s.results_stk) { mpc_free(i, s.results); }
+
+  *r = x;
+  return ok;
+
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+#undef MPC_CALL
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+  x = mpc_parse_run(i, p, r, &e);
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -1336,12 +1962,41 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
 
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
+  long offset;
+  mpc_input_t *i = NULL;
+
+#ifdef MPC_USE_MMAP
+  i = mpc_input_new_mapped(filename, file);
+  if (i) {
+    offset = ftell(file);
+    x = mpc_parse_input(i, p, r);
+    fseek(file, offset + i->state.pos, SEEK_SET);
+    mpc_input_delete(i);
+    return x;
+  }
+#endif
+
+  /* Files that can't be seeked are read like a pipe */
+  offset = ftell(file);
+  if (offset < 0 || fseek(file, offset, SEEK_SET) != 0) {
+    return mpc_parse_pipe(filename, file, p, r);
+  }
+
+  i = mpc_input_new_file(filename, file);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
 }
 
+/*
+** Pipes are read in blocks, so whatever follows
+** the parsed input in the same block is consumed
+** as well. `mpc_parse_pipe` drops it, and
+** `mpc_parse_pipe_rest` returns it in *rest, to
+** be freed by the caller, so that it can be fed
+** to whatever reads next.
+*/
+
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
@@ -1350,6 +2005,15 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+int mpc_parse_pipe_rest(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r, char **rest, size_t *rest_len) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  *rest = mpc_input_buffer_rest(i, rest_len);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
   FILE *f = fopen(filename, "rb");
@@ -1379,6 +2043,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.first);
 
 }
 
@@ -1440,6 +2105,13 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.check_with.e);
       break;
 
+    case MPC_TYPE_MEMO: mpc_undefine_unretained(p->data.memo.x, 0); break;
+
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -1541,6 +2213,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.first) {
+        p->data.or.first = malloc(a->data.or.first_num * sizeof(int));
+        memcpy(p->data.or.first, a->data.or.first, a->data.or.first_num * sizeof(int));
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1564,6 +2240,13 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_MEMO: p->data.memo.x = mpc_copy(a->data.memo.x); break;
+
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.d = mpc_dfa_copy(a->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -1874,6 +2557,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_copy_t c, mpc_dtor_t d) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.c = c;
+  p->data.memo.d = d;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -1935,6 +2627,8 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+  p->data.or.first_num = 0;
 
   va_start(va, n);
   for (i = 0; i < n; i++) {
@@ -2214,140 +2908,650 @@ static mpc_parser_t *mpc_re_escape_char(char c) {
     case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
     default: return NULL;
   }
-}
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+
+  int mode = *((int*)data);
+  char *s = x;
+  mpc_parser_t *p;
+
+  /* Any Character */
+  if (s[0] == '.') {
+    free(s);
+    if (mode & MPC_RE_DOTALL) {
+      return mpc_any();
+    } else {
+      return mpc_expect(mpc_noneof("\n"), "any character except a newline");
+    }
+  }
+
+  /* Start of Input */
+  if (s[0] == '^') {
+    free(s);
+    if (mode & MPC_RE_MULTILINE) {
+      return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
+    } else {
+      return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    }
+  }
+
+  /* End of Input */
+  if (s[0] == '$') {
+    free(s);
+    if (mode & MPC_RE_MULTILINE) {
+      return mpc_or(2,
+        mpc_newline(),
+        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+    } else {
+      return mpc_or(2,
+        mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
+        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+    }
+  }
+
+  /* Regex Escape */
+  if (s[0] == '\\') {
+    p = mpc_re_escape_char(s[1]);
+    p = (p == NULL) ? mpc_char(s[1]) : p;
+    free(s);
+    return p;
+  }
+
+  /* Regex Standard */
+  p = mpc_char(s[0]);
+  free(s);
+  return p;
+}
+
+static const char *mpc_re_range_escape_char(char c) {
+  switch (c) {
+    case '-': return "-";
+    case 'a': return "\a";
+    case 'f': return "\f";
+    case 'n': return "\n";
+    case 'r': return "\r";
+    case 't': return "\t";
+    case 'v': return "\v";
+    case 'b': return "\b";
+    case 'd': return "0123456789";
+    case 's': return " \f\n\r\t\v";
+    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+
+  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  if (s[0] == '^' &&
+      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+  for (i = comp; i < strlen(s); i++){
+
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];
+      }
+      i++;
+    }
+
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = (char)j;
+        }
+      }
+    }
+
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+
+  }
+
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+
+  free(x);
+  free(range);
+
+  return out;
+}
+
+/*
+** Compiling Regular Expressions
+**
+** The parser built from a regex never goes
+** back into a repetition, or on to the next
+** alternative of an `or` once one matched, so
+** it doesn't always find the longest match.
+** It does when every choice can be made on
+** the next byte alone, only the last
+** alternative of an `or` can match nothing,
+** and nothing repeated or optional can match
+** nothing. Such regexes are also compiled to
+** a DFA, and anything else is left as it is.
+**
+** States are the positions of the bytes in
+** the regex, after Glushkov, reading `many1`
+** as one copy followed by `many` and `count`
+** as copies in a row, so that each state is
+** also one point in the combinators. The
+** errors left at each state and class are
+** found by running the combinators on a
+** short input that leads there, and then
+** states that nothing tells apart, errors
+** included, are merged.
+*/
+
+enum {
+  MPC_DFA_POSITIONS_MAX = 128,
+  MPC_DFA_CELLS_MAX = 2048
+};
+
+typedef struct {
+  int num;
+  char *sets;
+  char *follow;
+} mpc_dfa_build_t;
+
+static int mpc_first(mpc_parser_t *p, char *set, int depth);
+
+static int mpc_dfa_class(mpc_parser_t *p) {
+  int j;
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      return 1;
+    case MPC_TYPE_EXPECT: return mpc_dfa_class(p->data.expect.x);
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_dfa_class(p->data.or.xs[j])) { return 0; }
+      }
+      return p->data.or.n > 0;
+    default: return 0;
+  }
+}
+
+static void mpc_dfa_follow(mpc_dfa_build_t *b, const char *last, const char *first) {
+  int q, r;
+  for (q = 1; q <= b->num; q++) {
+    if (!last[q]) { continue; }
+    for (r = 1; r <= b->num; r++) {
+      if (first[r]) { b->follow[q * (MPC_DFA_POSITIONS_MAX + 1) + r] = 1; }
+    }
+  }
+}
+
+static int mpc_dfa_positions(mpc_dfa_build_t *b, mpc_parser_t *p, int safe, char *first, char *last);
+
+/*
+** Appends `p`, or `many` of `p`, to a sequence
+** with the given first and last positions.
+** Returns if the sequence can still match
+** nothing, or -1 if it can't be compiled.
+*/
+
+static int mpc_dfa_append(mpc_dfa_build_t *b, mpc_parser_t *p, int safe, int many, char *first, char *last, int nullable) {
+
+  int j, r;
+  char *f = calloc(MPC_DFA_POSITIONS_MAX + 1, 2);
+  char *l = f + MPC_DFA_POSITIONS_MAX + 1;
+
+  r = mpc_dfa_positions(b, p, safe && !many, f, l);
+  if (r == 1 && many) { r = -1; }
+  if (r == -1) { free(f); return -1; }
+
+  if (many) {
+    mpc_dfa_follow(b, l, f);
+    r = 1;
+  }
+
+  mpc_dfa_follow(b, last, f);
+  for (j = 0; j <= MPC_DFA_POSITIONS_MAX; j++) {
+    if (nullable) { first[j] |= f[j]; }
+    last[j] = r ? last[j] | l[j] : l[j];
+  }
+
+  free(f);
+  return nullable && r;
+}
+
+/*
+** Adds the positions `p` may start and end on
+** to `first` and `last`. Returns if `p` can
+** match nothing, or -1 if it can't be compiled.
+**
+** A `count` that fails part way through keeps
+** what it consumed, so it is only compiled
+** where an `and` rewinds the input after it,
+** which is what `safe` says.
+*/
+
+static int mpc_dfa_positions(mpc_dfa_build_t *b, mpc_parser_t *p, int safe, char *first, char *last) {
+
+  int j, n, r;
+  char *f, *l;
+
+  if (mpc_dfa_class(p)) {
+    if (b->num == MPC_DFA_POSITIONS_MAX) { return -1; }
+    b->num++;
+    mpc_first(p, b->sets + b->num * 256, 0);
+    first[b->num] = 1;
+    last[b->num] = 1;
+    return 0;
+  }
+
+  switch (p->type) {
+
+    case MPC_TYPE_LIFT:
+      return p->data.lift.lf == mpcf_ctor_str ? 1 : -1;
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return -1; }
+      return mpc_dfa_positions(b, p->data.not.x, 0, first, last) == 0 ? 1 : -1;
+
+    case MPC_TYPE_OR:
+      r = -1;
+      for (j = 0; j < p->data.or.n; j++) {
+        r = mpc_dfa_positions(b, p->data.or.xs[j], 0, first, last);
+        if (r == -1 || (r == 1 && j < p->data.or.n-1)) { return -1; }
+      }
+      return r;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return -1; }
+      n = p->data.and.n;
+      break;
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold || p->data.repeat.n < 1) { return -1; }
+      if (p->data.repeat.n > 1 && !safe) { return -1; }
+      n = p->data.repeat.n;
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return -1; }
+      n = p->type == MPC_TYPE_MANY1 ? 2 : 1;
+      break;
+
+    default: return -1;
+  }
+
+  f = calloc(MPC_DFA_POSITIONS_MAX + 1, 2);
+  l = f + MPC_DFA_POSITIONS_MAX + 1;
+
+  r = 1;
+  for (j = 0; j < n && r != -1; j++) {
+    if (p->type == MPC_TYPE_AND) {
+      r = mpc_dfa_append(b, p->data.and.xs[j], 1, 0, f, l, r);
+    } else {
+      r = mpc_dfa_append(b, p->data.repeat.x, safe, p->type != MPC_TYPE_COUNT && j == n-1, f, l, r);
+    }
+  }
+
+  for (j = 0; j <= MPC_DFA_POSITIONS_MAX; j++) {
+    first[j] |= f[j];
+    last[j] |= l[j];
+  }
+
+  free(f);
+  return r;
+}
+
+/*
+** Runs the combinators on `s`, giving how much
+** they matched, or -1, and a copy of the error
+** at the furthest byte anything failed on.
+*/
+
+static long mpc_dfa_try(mpc_parser_t *x, const char *s, mpc_err_t **err) {
+
+  long n = -1;
+  mpc_result_t r;
+  mpc_err_t *e = NULL;
+  mpc_input_t *i = mpc_input_new_string("<mpc_re_compiler>", s);
+
+  if (mpc_parse_run(i, x, &r, &e)) {
+    n = i->state.pos;
+    mpc_free(i, r.output);
+  } else {
+    e = mpc_err_merge(i, e, r.error);
+  }
+
+  *err = mpc_err_copy(e);
+  mpc_err_delete_internal(i, e);
+  mpc_input_delete(i);
+  return n;
+}
+
+/*
+** Works out the errors left at state `q` on a
+** byte `c` when it is followed by `u`. Returns
+** 0 if the combinators don't agree with the
+** DFA on that input, which is taken as a sign
+** it shouldn't be used.
+*/
+
+static int mpc_dfa_template(mpc_dfa_t *d, mpc_parser_t *x, char **ws, int q, int c, const char *u) {
+
+  int j, k, f;
+  long n, fail;
+  mpc_err_t *err;
+  size_t l = strlen(ws[q]);
+  char *s = malloc(l + strlen(u) + 2);
+
+  strcpy(s, ws[q]);
+  s[l] = (char)c;
+  s[l+1] = '\0';
+  if (c) { strcat(s, u); }
+
+  n = mpc_dfa_try(x, s, &err);
+  k = q * d->classes + d->cls[c];
+  d->errs[k] = -1;
+
+  if (n != mpc_dfa_scan(d, s, &fail, &f)
+  || (err && err->state.pos > (long)l)
+  || (err && err->state.pos == (long)l && (err->failure || err->expected_num == 0))) {
+    if (err) { mpc_err_delete(err); }
+    free(s);
+    return 0;
+  }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+  free(s);
 
-  int mode = *((int*)data);
-  char *s = x;
-  mpc_parser_t *p;
+  if (err == NULL || err->state.pos < (long)l) {
+    if (err) { mpc_err_delete(err); }
+    return 1;
+  }
 
-  /* Any Character */
-  if (s[0] == '.') {
-    free(s);
-    if (mode & MPC_RE_DOTALL) {
-      return mpc_any();
-    } else {
-      return mpc_expect(mpc_noneof("\n"), "any character except a newline");
+  for (j = 0; j < d->templates_num; j++) {
+    if (d->templates[j]->expected_num != err->expected_num) { continue; }
+    for (f = 0; f < err->expected_num; f++) {
+      if (strcmp(d->templates[j]->expected[f], err->expected[f]) != 0) { break; }
     }
+    if (f == err->expected_num) { break; }
   }
 
-  /* Start of Input */
-  if (s[0] == '^') {
-    free(s);
-    if (mode & MPC_RE_MULTILINE) {
-      return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
-    } else {
-      return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    }
+  if (j < d->templates_num) {
+    mpc_err_delete(err);
+  } else {
+    d->templates = realloc(d->templates, sizeof(mpc_err_t*) * (d->templates_num + 1));
+    d->templates[d->templates_num++] = err;
   }
 
-  /* End of Input */
-  if (s[0] == '$') {
-    free(s);
-    if (mode & MPC_RE_MULTILINE) {
-      return mpc_or(2,
-        mpc_newline(),
-        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
-    } else {
-      return mpc_or(2,
-        mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
-        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+  d->errs[k] = j;
+  return 1;
+}
+
+static int mpc_dfa_same(mpc_dfa_t *d, const int *block, int q, int r) {
+  int k, s, t;
+  if (block[q] != block[r] || d->accept[q] != d->accept[r]) { return 0; }
+  for (k = 0; k < d->classes; k++) {
+    s = d->trans[q * d->classes + k];
+    t = d->trans[r * d->classes + k];
+    if (d->errs[q * d->classes + k] != d->errs[r * d->classes + k]) { return 0; }
+    if ((s == -1) != (t == -1)) { return 0; }
+    if (s != -1 && block[s] != block[t]) { return 0; }
+  }
+  return 1;
+}
+
+/*
+** Merges states that nothing tells apart, by
+** splitting them up until every state in a
+** group goes to the same groups.
+*/
+
+static mpc_dfa_t *mpc_dfa_minimise(mpc_dfa_t *d, char **ws) {
+
+  int j, k, q, r, t, n, num = 1;
+  int *block = calloc(d->states, sizeof(int));
+  int *next = malloc(sizeof(int) * d->states);
+  mpc_dfa_t *m;
+
+  while (1) {
+    n = 0;
+    for (q = 0; q < d->states; q++) {
+      next[q] = -1;
+      if (ws[q] == NULL) { continue; }
+      for (r = 0; r < q; r++) {
+        if (ws[r] && mpc_dfa_same(d, block, q, r)) { next[q] = next[r]; break; }
+      }
+      if (next[q] == -1) { next[q] = n++; }
     }
+    memcpy(block, next, sizeof(int) * d->states);
+    if (n == num) { break; }
+    num = n;
   }
 
-  /* Regex Escape */
-  if (s[0] == '\\') {
-    p = mpc_re_escape_char(s[1]);
-    p = (p == NULL) ? mpc_char(s[1]) : p;
-    free(s);
-    return p;
+  m = malloc(sizeof(mpc_dfa_t));
+  m->states = num;
+  m->classes = d->classes;
+  memcpy(m->cls, d->cls, 256);
+  m->accept = malloc(num);
+  m->trans = malloc(sizeof(int) * num * d->classes);
+  m->errs = malloc(sizeof(int) * num * d->classes);
+  m->templates_num = d->templates_num;
+  m->templates = d->templates;
+  d->templates_num = 0;
+  d->templates = NULL;
+
+  for (q = 0; q < d->states; q++) {
+    if (ws[q] == NULL) { continue; }
+    j = block[q];
+    m->accept[j] = d->accept[q];
+    for (k = 0; k < d->classes; k++) {
+      t = d->trans[q * d->classes + k];
+      m->trans[j * d->classes + k] = t == -1 ? -1 : block[t];
+      m->errs[j * d->classes + k] = d->errs[q * d->classes + k];
+    }
   }
 
-  /* Regex Standard */
-  p = mpc_char(s[0]);
-  free(s);
-  return p;
+  free(block);
+  free(next);
+  return m;
 }
 
-static const char *mpc_re_range_escape_char(char c) {
-  switch (c) {
-    case '-': return "-";
-    case 'a': return "\a";
-    case 'f': return "\f";
-    case 'n': return "\n";
-    case 'r': return "\r";
-    case 't': return "\t";
-    case 'v': return "\v";
-    case 'b': return "\b";
-    case 'd': return "0123456789";
-    case 's': return " \f\n\r\t\v";
-    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-    default: return NULL;
+static mpc_dfa_t *mpc_dfa_build(mpc_dfa_build_t *b, mpc_parser_t *x, const char *first, const char *last, int nullable) {
+
+  int j, k, q, r, t, c, n, head, changed, ok = 1;
+  int map[512], rep[256];
+  const char *from;
+  char **ws, **us;
+  int *queue;
+  size_t l;
+  mpc_dfa_t *d = calloc(1, sizeof(mpc_dfa_t));
+  mpc_dfa_t *m = NULL;
+
+  /* Split the bytes into classes by the positions they may take */
+
+  d->classes = 1;
+  for (q = 1; q <= b->num; q++) {
+    for (j = 0; j < d->classes * 2; j++) { map[j] = -1; }
+    n = 0;
+    for (c = 0; c < 256; c++) {
+      k = d->cls[c] * 2 + (b->sets[q * 256 + c] != 0);
+      if (map[k] == -1) { map[k] = n++; }
+      d->cls[c] = (unsigned char)map[k];
+    }
+    d->classes = n;
   }
-}
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  for (c = 0; c < 256; c++) { rep[d->cls[c]] = c; }
 
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  d->states = b->num + 1;
+  if (d->states * d->classes > MPC_DFA_CELLS_MAX) {
+    mpc_dfa_delete(d);
+    return NULL;
+  }
 
-  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
-  if (s[0] == '^' &&
-      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  d->accept = malloc(d->states);
+  d->trans = malloc(sizeof(int) * d->states * d->classes);
+  d->errs = malloc(sizeof(int) * d->states * d->classes);
+
+  /* Follow each class to at most one position */
+
+  for (q = 0; q < d->states; q++) {
+    d->accept[q] = q == 0 ? (char)nullable : last[q];
+    from = q == 0 ? first : b->follow + q * (MPC_DFA_POSITIONS_MAX + 1);
+    for (k = 0; k < d->classes; k++) {
+      t = -1;
+      for (r = 1; r <= b->num; r++) {
+        if (!from[r] || !b->sets[r * 256 + rep[k]]) { continue; }
+        if (t != -1) { mpc_dfa_delete(d); return NULL; }
+        t = r;
+      }
+      d->trans[q * d->classes + k] = t;
+      d->errs[q * d->classes + k] = -1;
+    }
+  }
 
-  for (i = comp; i < strlen(s); i++){
+  /* Find the shortest input leading to each state */
+
+  ws = calloc(d->states, sizeof(char*));
+  us = calloc(d->states, sizeof(char*));
+  queue = malloc(sizeof(int) * d->states);
+  ws[0] = calloc(1, 1);
+  queue[0] = 0;
+  n = 1;
+  for (head = 0; head < n; head++) {
+    q = queue[head];
+    l = strlen(ws[q]);
+    for (k = 0; k < d->classes; k++) {
+      t = d->trans[q * d->classes + k];
+      if (t == -1 || ws[t]) { continue; }
+      ws[t] = malloc(l + 2);
+      strcpy(ws[t], ws[q]);
+      ws[t][l] = (char)rep[k];
+      ws[t][l+1] = '\0';
+      queue[n++] = t;
+    }
+  }
 
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];
+  /* Errors where the DFA stops */
+
+  for (q = 0; q < d->states && ok; q++) {
+    if (ws[q] == NULL) { continue; }
+    for (k = 0; k < d->classes && ok; k++) {
+      if (d->trans[q * d->classes + k] != -1) { continue; }
+      ok = mpc_dfa_template(d, x, ws, q, rep[k], "");
+      if (ok && us[q] == NULL && d->errs[q * d->classes + k] == -1) {
+        us[q] = calloc(1, 2);
+        us[q][0] = (char)rep[k];
       }
-      i++;
     }
+  }
 
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
+  /*
+  ** Find the states from which some input leads
+  ** to the DFA stopping with no more failures.
+  ** The errors of a step before one of these
+  ** may be the last made, so they are needed,
+  ** but those of any other step never are.
+  */
+
+  changed = 1;
+  while (changed && ok) {
+    changed = 0;
+    for (q = 0; q < d->states && ok; q++) {
+      if (ws[q] == NULL || us[q]) { continue; }
+      for (k = 0; k < d->classes && ok; k++) {
+        t = d->trans[q * d->classes + k];
+        if (t == -1 || us[t] == NULL) { continue; }
+        ok = mpc_dfa_template(d, x, ws, q, rep[k], us[t]);
+        if (ok && d->errs[q * d->classes + k] == -1) {
+          us[q] = malloc(strlen(us[t]) + 2);
+          us[q][0] = (char)rep[k];
+          strcpy(us[q] + 1, us[t]);
+          changed = 1;
+          break;
         }
       }
     }
+  }
 
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+  /* Errors of the steps before those */
+
+  for (q = 0; q < d->states && ok; q++) {
+    if (ws[q] == NULL) { continue; }
+    for (k = 0; k < d->classes && ok; k++) {
+      t = d->trans[q * d->classes + k];
+      if (t == -1 || us[t] == NULL) { continue; }
+      ok = mpc_dfa_template(d, x, ws, q, rep[k], us[t]);
     }
+  }
 
+  if (ok) { m = mpc_dfa_minimise(d, ws); }
+
+  for (q = 0; q < d->states; q++) {
+    free(ws[q]);
+    free(us[q]);
   }
+  free(ws);
+  free(us);
+  free(queue);
+  mpc_dfa_delete(d);
+  return m;
+}
 
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+static mpc_parser_t *mpc_dfa_compile(mpc_parser_t *x) {
 
-  free(x);
-  free(range);
+  mpc_dfa_build_t b;
+  mpc_dfa_t *d = NULL;
+  mpc_parser_t *p;
+  int nullable;
+  char *first = calloc(MPC_DFA_POSITIONS_MAX + 1, 2);
+  char *last = first + MPC_DFA_POSITIONS_MAX + 1;
 
-  return out;
+  b.num = 0;
+  b.sets = calloc(MPC_DFA_POSITIONS_MAX + 1, 256);
+  b.follow = calloc(MPC_DFA_POSITIONS_MAX + 1, MPC_DFA_POSITIONS_MAX + 1);
+
+  nullable = mpc_dfa_positions(&b, x, 1, first, last);
+  if (nullable != -1) { d = mpc_dfa_build(&b, x, first, last, nullable); }
+
+  free(first);
+  free(b.sets);
+  free(b.follow);
+
+  if (d == NULL) { return x; }
+
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = x;
+  p->data.dfa.d = d;
+  return p;
 }
 
 mpc_parser_t *mpc_re(const char *re) {
@@ -2417,7 +3621,7 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   mpc_optimise(r.output);
 
-  return r.output;
+  return mpc_dfa_compile(r.output);
 
 }
 
@@ -2769,6 +3973,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2900,6 +4106,26 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *b;
+
+  if (a == NULL) { return NULL; }
+
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy(a->children[i]);
+  }
+
+  return b;
+
+}
+
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
@@ -3294,6 +4520,8 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+  p->data.or.first_num = 0;
 
   va_start(va, n);
   for (i = 0; i < n; i++) {
@@ -3649,18 +4877,24 @@ static void mpca_stmt_list_delete(mpc_val_t *x) {
 
 }
 
+static void mpc_first_unretained(mpc_parser_t *p, int force);
+
 static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
   mpca_grammar_st_t *st = s;
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
   mpc_parser_t *left;
+  int i;
 
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_MEMOIZE) {
+      stmt->grammar = mpc_memo(stmt->grammar, (mpc_copy_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete);
+    }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
@@ -3671,6 +4905,11 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
   free(x);
 
+  /* Rules can refer to rules defined after them, so predict once all are defined */
+  for (i = 0; i < st->parsers_num; i++) {
+    mpc_first_unretained(st->parsers[i], 1);
+  }
+
   return NULL;
 }
 
@@ -3855,6 +5094,8 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3892,6 +5133,225 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
 }
 
+/*
+** First Sets
+**
+** Finds every byte `p` may consume first, and
+** whether it may succeed without consuming any
+** input, fail after consuming some, or can't be
+** analysed at all. Rules are followed through
+** references, up to a depth that also stops
+** left recursion.
+*/
+
+enum {
+  MPC_FIRST_NULLABLE = 1,
+  MPC_FIRST_UNCLEAN  = 2,
+  MPC_FIRST_UNKNOWN  = 4,
+
+  MPC_FIRST_DEPTH_MAX = 64
+};
+
+static int mpc_first(mpc_parser_t *p, char *set, int depth) {
+
+  int i, r, f;
+
+  if (depth > MPC_FIRST_DEPTH_MAX) { return MPC_FIRST_UNKNOWN; }
+  depth++;
+
+  switch (p->type) {
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      return MPC_FIRST_NULLABLE;
+
+    case MPC_TYPE_FAIL: return 0;
+
+    case MPC_TYPE_ANY:
+      for (i = 1; i < 256; i++) { set[i] = 1; }
+      return 0;
+
+    case MPC_TYPE_SINGLE:
+      if (p->data.single.x) { set[(unsigned char)p->data.single.x] = 1; }
+      return 0;
+
+    case MPC_TYPE_RANGE:
+      for (i = 1; i < 256; i++) {
+        if ((char)i >= p->data.range.x && (char)i <= p->data.range.y) { set[i] = 1; }
+      }
+      return 0;
+
+    case MPC_TYPE_ONEOF:
+      for (i = 1; i < 256; i++) {
+        if (strchr(p->data.string.x, (char)i) != 0) { set[i] = 1; }
+      }
+      return 0;
+
+    case MPC_TYPE_NONEOF:
+      for (i = 1; i < 256; i++) {
+        if (strchr(p->data.string.x, (char)i) == 0) { set[i] = 1; }
+      }
+      return 0;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return MPC_FIRST_NULLABLE; }
+      set[(unsigned char)p->data.string.x[0]] = 1;
+      return 0;
+
+    case MPC_TYPE_EXPECT:   return mpc_first(p->data.expect.x, set, depth);
+    case MPC_TYPE_APPLY:    return mpc_first(p->data.apply.x, set, depth);
+    case MPC_TYPE_APPLY_TO: return mpc_first(p->data.apply_to.x, set, depth);
+    case MPC_TYPE_MEMO:     return mpc_first(p->data.memo.x, set, depth);
+    case MPC_TYPE_DFA:      return mpc_first(p->data.dfa.x, set, depth);
+
+    case MPC_TYPE_CHECK:      return mpc_first(p->data.check.x, set, depth) | MPC_FIRST_UNCLEAN;
+    case MPC_TYPE_CHECK_WITH: return mpc_first(p->data.check_with.x, set, depth) | MPC_FIRST_UNCLEAN;
+    case MPC_TYPE_PREDICT:    return mpc_first(p->data.predict.x, set, depth) | MPC_FIRST_UNCLEAN;
+
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      r = mpc_first(p->data.not.x, set, depth);
+      return (r & MPC_FIRST_UNKNOWN) | MPC_FIRST_NULLABLE;
+
+    case MPC_TYPE_MANY:
+      r = mpc_first(p->data.repeat.x, set, depth);
+      return (r & MPC_FIRST_UNKNOWN) | MPC_FIRST_NULLABLE;
+
+    case MPC_TYPE_MANY1: return mpc_first(p->data.repeat.x, set, depth);
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n == 0) { return MPC_FIRST_NULLABLE; }
+      r = mpc_first(p->data.repeat.x, set, depth);
+      return p->data.repeat.n > 1 ? r | MPC_FIRST_UNCLEAN : r;
+
+    case MPC_TYPE_OR:
+      f = 0;
+      for (i = 0; i < p->data.or.n; i++) {
+        f |= mpc_first(p->data.or.xs[i], set, depth);
+      }
+      return p->data.or.n == 0 ? MPC_FIRST_NULLABLE : f;
+
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) {
+        r = mpc_first(p->data.and.xs[i], set, depth);
+        if (r & MPC_FIRST_UNKNOWN) { return MPC_FIRST_UNKNOWN; }
+        if (!(r & MPC_FIRST_NULLABLE)) { return 0; }
+      }
+      return MPC_FIRST_NULLABLE;
+
+    default: return MPC_FIRST_UNKNOWN;
+  }
+
+}
+
+/*
+** Builds the prediction table of an `or`. The
+** first 256 entries give, for each byte, the
+** offset of a list of alternatives ending in
+** -1. Bytes that rule out every alternative or
+** none share an empty list, as then there is
+** nothing to gain over trying them all.
+*/
+
+static int mpc_first_same(const int *xs, const int *ys) {
+  for (; *xs == *ys; xs++, ys++) { if (*xs == -1) { return 1; } }
+  return 0;
+}
+
+static void mpc_first_build(mpc_parser_t *p) {
+
+  int i, j, k, n = p->data.or.n;
+  int num, rows_num, rows[256], *row, *first;
+  char *sets;
+
+  free(p->data.or.first);
+  p->data.or.first = NULL;
+  p->data.or.first_num = 0;
+
+  if (n < 2) { return; }
+
+  sets = calloc(n, 256);
+  for (j = 0; j < n; j++) {
+    if (mpc_first(p->data.or.xs[j], sets + j * 256, 0) != 0) {
+      free(sets);
+      return;
+    }
+  }
+
+  row = malloc(sizeof(int) * (n + 1));
+  first = malloc(sizeof(int) * (256 + 1));
+  first[256] = -1;
+  num = 256 + 1;
+  rows_num = 0;
+
+  for (i = 0; i < 256; i++) {
+
+    k = 0;
+    for (j = 0; j < n; j++) {
+      if (sets[j * 256 + i]) { row[k++] = j; }
+    }
+    row[k] = -1;
+
+    first[i] = 256;
+    if (k == 0 || k == n) { continue; }
+
+    for (j = 0; j < rows_num; j++) {
+      if (mpc_first_same(first + rows[j], row)) { first[i] = rows[j]; break; }
+    }
+    if (j < rows_num) { continue; }
+
+    first = realloc(first, sizeof(int) * (num + k + 1));
+    memcpy(first + num, row, sizeof(int) * (k + 1));
+    first[i] = rows[rows_num++] = num;
+    num += k + 1;
+  }
+
+  free(row);
+  free(sets);
+  p->data.or.first = first;
+  p->data.or.first_num = num;
+}
+
+static void mpc_first_unretained(mpc_parser_t *p, int force) {
+
+  int i;
+
+  if (p->retained && !force) { return; }
+
+  if (p->type == MPC_TYPE_EXPECT)     { mpc_first_unretained(p->data.expect.x, 0); }
+  if (p->type == MPC_TYPE_APPLY)      { mpc_first_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_first_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_CHECK)      { mpc_first_unretained(p->data.check.x, 0); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_first_unretained(p->data.check_with.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)    { mpc_first_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)       { mpc_first_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)        { mpc_first_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_NOT)        { mpc_first_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE)      { mpc_first_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MANY)       { mpc_first_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1)      { mpc_first_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT)      { mpc_first_unretained(p->data.repeat.x, 0); }
+
+  if (p->type == MPC_TYPE_AND) {
+    for (i = 0; i < p->data.and.n; i++) {
+      mpc_first_unretained(p->data.and.xs[i], 0);
+    }
+  }
+
+  if (p->type == MPC_TYPE_OR) {
+    for (i = 0; i < p->data.or.n; i++) {
+      mpc_first_unretained(p->data.or.xs[i], 0);
+    }
+    mpc_first_build(p);
+  }
+
+}
+
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
   int i, n, m;
@@ -3907,6 +5367,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)       { mpc_optimise_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)        { mpc_optimise_unretained(p->data.dfa.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -3938,7 +5400,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
       continue;
     }
 
@@ -3952,7 +5414,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
       continue;
     }
 
@@ -4055,10 +5517,12 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
-    return;
+    break;
 
   }
 
+  if (p->type == MPC_TYPE_OR) { mpc_first_build(p); }
+
 }
 
 void mpc_optimise(mpc_parser_t *p) {
@@ -1,21 +1,92 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
 
-#include <editline/readline.h>
 #include "mpc.h"
 #include "parsing.h"
+#include "reader.h"
+#include "image.h"
+#include "serial.h"
+#include "pool.h"
+#include "future.h"
+#include "coro.h"
+#include "interp.h"
 
 // TODO: Make builtin_op less ugly
 
 
-// Evalutes a passed S-Expression
-// Returns the evaluated expression
-lval* lval_eval_sexpr(lenv *e, lval *v) {
-  // Evaluate children
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+// Room a stack starts with in its owner's C frame, enough for most values
+// and expressions without going to the heap
+#define LSTACK_INLINE 32
+
+// Doubles the room of a stack that starts out in local and moves to the
+// heap once it outgrows it. Returns where the items now are.
+static void* lstack_grow(void *items, void *local, int *slots, size_t size) {
+  void *grown;
+  if (items == local) {
+    grown = malloc(size * *slots * 2);
+    memcpy(grown, items, size * *slots);
+  } else {
+    grown = realloc(items, size * *slots * 2);
   }
+  *slots *= 2;
+  return grown;
+}
+
+// A stack of lvals, for walking nested lists without recursing so their
+// depth isn't limited by the C stack
+typedef struct {
+  lval **items;
+  int count;
+  int slots;
+  lval *local[LSTACK_INLINE];
+} lstack;
+
+static void lstack_init(lstack *s) {
+  s->items = s->local;
+  s->count = 0;
+  s->slots = LSTACK_INLINE;
+}
+
+static void lstack_push(lstack *s, lval *v) {
+  if (s->count == s->slots) {
+    s->items = lstack_grow(s->items, s->local, &s->slots, sizeof(lval*));
+  }
+  s->items[s->count++] = v;
+}
+
+static void lstack_free(lstack *s) {
+  if (s->items != s->local) { free(s->items); }
+}
+
+// An S-Expression on the evaluator's stack. Its children are evaluated in
+// place from left to right, then it is applied. A frame whose expression
+// has been applied but whose value comes from a lambda body above it has v
+// set to NULL.
+typedef struct {
+  lenv *e;
+  lval *v;
+  int next;
+
+  // Activation frame of a lambda call, deleted with this
+  lenv *frame;
+} leval_frame;
+
+static lval* lval_bind(lenv *e, lval *f, lval *a, lenv **frame);
+
+// Applies an S-Expression whose children have been evaluated. Returns its
+// value, or NULL when the value is that of *body evaluated in *env. *frame
+// is then a new activation frame to delete afterwards, or NULL.
+static lval* lval_apply(lenv *e, lval *v, lval **body, lenv **env,
+  lenv **frame) {
+  // Every path sets the outputs, including those returning a value
+  *body = NULL;
+  *env = e;
+  *frame = NULL;
 
   // Error checking
   for (int i = 0; i < v->count; i++) {
@@ -28,29 +99,113 @@ lval* lval_eval_sexpr(lenv *e, lval *v) {
   // Ensure first element is a function after evaluation
   lval *f = lval_pop(v, 0);
   if (f->type != LVAL_FUN) {
-    lval *err = lval_err("S-Expression starts with incorrect type. "
-     "Got %s, expected %s.",
+    lval *err = lval_err(LERR_SEXPR_START,
      ltype_name(f->type), ltype_name(LVAL_FUN));
     lval_del(f);
     lval_del(v);
     return err;
   }
 
-  lval *result = lval_call(e, f, v);
+  // eval and lambda bodies continue on the evaluator's stack instead of
+  // calling back into it
+  lval *x = NULL;
+  if (f->builtin == builtin_eval && v->count == 1 &&
+    v->cell[0]->type == LVAL_QEXPR) {
+    *body = lval_take(v, 0);
+    *env = e;
+  } else if (f->builtin) {
+    x = f->builtin(e, v);
+  } else if (!(x = lval_bind(e, f, v, frame))) {
+    *body = lval_copy(f->body);
+    *env = *frame;
+  }
+
+  if (!x) { (*body)->type = LVAL_SEXPR; }
   lval_del(f);
-  return result;
+  return x;
 }
 
-
-// Evaluate an expression
+// Evaluates an expression. Nested S-Expressions and function bodies are
+// kept on a stack of frames on the heap rather than the C stack, so only
+// builtins that evaluate their arguments themselves, like par, recurse.
 lval* lval_eval(lenv *e, lval *v) {
   if (v->type == LVAL_SYM) {
     lval *x = lenv_get(e, v);
     lval_del(v);
     return x;
   }
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-  return v;
+  if (v->type != LVAL_SEXPR) { return v; }
+
+  leval_frame local[LSTACK_INLINE];
+  leval_frame *stack = local;
+  int slots = LSTACK_INLINE;
+  int n = 1;
+  stack[0] = (leval_frame){ e, v, 0, NULL };
+
+  for (;;) {
+    leval_frame *top = &stack[n - 1];
+
+    // Evaluate the next child, symbols and atoms straight away
+    if (top->next < top->v->count) {
+      lval *c = top->v->cell[top->next];
+      if (c->type == LVAL_SEXPR) {
+        if (n == slots) {
+          stack = lstack_grow(stack, local, &slots, sizeof(leval_frame));
+          top = &stack[n - 1];
+        }
+        stack[n++] = (leval_frame){ top->e, c, 0, NULL };
+        continue;
+      }
+      if (c->type == LVAL_SYM) {
+        top->v->cell[top->next] = lenv_get(top->e, c);
+        lval_del(c);
+      }
+      top->next++;
+      continue;
+    }
+
+    lval *body;
+    lenv *env, *frame;
+    lval *x = lval_apply(top->e, top->v, &body, &env, &frame);
+    if (!x) {
+      // The body takes the expression's place. A lambda's frame has the
+      // caller's environment as parent, so if that is itself a frame it
+      // stays below until the body is done.
+      if (frame && top->frame) {
+        top->v = NULL;
+        if (n == slots) {
+          stack = lstack_grow(stack, local, &slots, sizeof(leval_frame));
+        }
+        stack[n++] = (leval_frame){ env, body, 0, frame };
+      } else {
+        top->e = env;
+        top->v = body;
+        top->next = 0;
+        if (frame) { top->frame = frame; }
+      }
+      continue;
+    }
+
+    // Hand the value down to the first frame still evaluating children
+    for (;;) {
+      if (stack[n - 1].frame) { lenv_del(stack[n - 1].frame); }
+      if (--n == 0) {
+        if (stack != local) { free(stack); }
+        return x;
+      }
+      top = &stack[n - 1];
+      if (top->v) {
+        top->v->cell[top->next++] = x;
+        break;
+      }
+    }
+  }
+}
+
+// Evalutes a passed S-Expression
+// Returns the evaluated expression
+lval* lval_eval_sexpr(lenv *e, lval *v) {
+  return lval_eval(e, v);
 }
 
 // Extracts a single element from an expression at index i and shifts the
@@ -121,8 +276,6 @@ lval* builtin_op(lenv *e, lval *v, char* op) {
         y->num.num_double = y_num;
         y->type = LVAL_NUM_DOUBLE;
       }
-      //LASSERT_TYPE(op, v, v->count, LVAL_NUM_LONG);
-      LASSERT_TYPE(op, v, v->count, LVAL_NUM_DOUBLE);
       if (strcmp(op, "+") == 0 || strcmp(op, "add") == 0) {
         x->num.num_double += y->num.num_double;
       }
@@ -136,12 +289,16 @@ lval* builtin_op(lenv *e, lval *v, char* op) {
         if (y->num.num_double == 0) {
           lval_del(x);
           lval_del(y);
-          return lval_err("Error: Divison by zero.");
+          lval_del(v);
+          return lval_err(LERR_DIV_ZERO);
         }
         x->num.num_double /= y->num.num_double;
       }
       if (strcmp(op, "%") == 0) {
-        return lval_err("Error: Non-integer modulo.");
+        lval_del(x);
+        lval_del(y);
+        lval_del(v);
+        return lval_err(LERR_MOD_FLOAT);
       }
       if (strcmp(op, "pow") == 0) {
         x->num.num_double = (pow(x->num.num_double, y->num.num_double));
@@ -168,7 +325,8 @@ lval* builtin_op(lenv *e, lval *v, char* op) {
         if (y->num.num_long == 0) {
           lval_del(x);
           lval_del(y);
-          return lval_err("Error: Divison by zero.");
+          lval_del(v);
+          return lval_err(LERR_DIV_ZERO);
         }
         x->num.num_long /= y->num.num_long;
       }
@@ -245,8 +403,12 @@ lval* builtin_print(lenv *e, lval *a) {
   return lenv_print(e);
 }
 
-void builtin_exit(lenv *e, lval *a) {
-  return exit(2);
+// Stops the evaluation it is part of. The error propagates like any other,
+// and whoever runs the evaluation decides what exiting ends: the REPL ends
+// the process, the server the connection.
+lval* builtin_exit(lenv *e, lval *a) {
+  lval_del(a);
+  return lval_err(LERR_EXIT);
 }
 
 lval* builtin_def(lenv *e, lval *a) {
@@ -257,6 +419,415 @@ lval* builtin_put(lenv *e, lval *a) {
   return builtin_var(e, a, "=");
 }
 
+// Saves the global environment to an image, the path is given as a quoted
+// symbol, e.g. (save-image {prelude_img})
+lval* builtin_save_image(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("save-image", a, 1);
+  LASSERT_TYPE("save-image", a, 0, LVAL_QEXPR);
+  LASSERT_PATH("save-image", a, 0);
+
+  while (e->par) { e = e->par; }
+
+  lval *path = a->cell[0]->cell[0];
+  lval *x = image_save(e, path->sym) == 0
+    ? lval_sexpr() : lval_err(LERR_IMAGE_WRITE, path->sym);
+  lval_del(a);
+  return x;
+}
+
+// Writes a value to a file in the binary encoding, the path is given as a
+// quoted symbol, e.g. (serialize {xs_bin} xs)
+lval* builtin_serialize(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("serialize", a, 2);
+  LASSERT_TYPE("serialize", a, 0, LVAL_QEXPR);
+  LASSERT_PATH("serialize", a, 0);
+
+  lval *path = a->cell[0]->cell[0];
+  lval *x = lval_save(a->cell[1], path->sym) == 0
+    ? lval_sexpr() : lval_err(LERR_FILE_WRITE, path->sym);
+  lval_del(a);
+  return x;
+}
+
+// Reads back a value written by serialize, e.g. (deserialize {xs_bin})
+lval* builtin_deserialize(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("deserialize", a, 1);
+  LASSERT_TYPE("deserialize", a, 0, LVAL_QEXPR);
+  LASSERT_PATH("deserialize", a, 0);
+
+  lval *path = a->cell[0]->cell[0];
+  lval *x = lval_load(path->sym);
+  if (!x) { x = lval_err(LERR_FILE_READ, path->sym); }
+  lval_del(a);
+  return x;
+}
+
+// An argument of par being evaluated on the thread pool
+typedef struct {
+  lenv *e;
+  lval **slot;
+} lpar_arg;
+
+static void lpar_eval(void *arg) {
+  lpar_arg *p = arg;
+  *p->slot = lval_eval(p->e, *p->slot);
+}
+
+// Evaluates every Q-Expression in a as an S-Expression, in parallel, and
+// leaves the results in its cells. Returns the index of the first error or
+// -1. The expressions must not depend on each other's side effects.
+static int lpar_eval_cells(lenv *e, lval *a, int from) {
+  int n = a->count - from;
+  for (int i = from; i < a->count; i++) {
+    a->cell[i]->type = LVAL_SEXPR;
+  }
+
+  if (n > 1 && lpool_size() > 1) {
+    ltask *tasks = malloc(sizeof(ltask) * n);
+    lpar_arg *args = malloc(sizeof(lpar_arg) * n);
+    for (int i = 0; i < n; i++) {
+      args[i].e = e;
+      args[i].slot = &a->cell[from + i];
+      tasks[i].fn = lpar_eval;
+      tasks[i].arg = &args[i];
+    }
+
+    lenv_share(e);
+    lpool_run(tasks, n);
+    lenv_unshare(e);
+
+    free(tasks);
+    free(args);
+  } else {
+    for (int i = from; i < a->count; i++) {
+      a->cell[i] = lval_eval(e, a->cell[i]);
+    }
+  }
+
+  for (int i = from; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_ERR) { return i; }
+  }
+  return -1;
+}
+
+// Evaluates each Q-Expression argument at the same time and returns a list
+// of the results, e.g. (par {f a} {g b}) gives {(f a) (g b)}
+lval* builtin_par(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("par", a, i, LVAL_QEXPR);
+  }
+
+  int err = lpar_eval_cells(e, a, 0);
+  if (err >= 0) { return lval_take(a, err); }
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+// Calls a function with arguments evaluated in parallel, each given as a
+// Q-Expression, e.g. (pcall + {f a} {g b} {h c})
+lval* builtin_pcall(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0, LERR_NUM_ARGS, "pcall", a->count, 1);
+  LASSERT_TYPE("pcall", a, 0, LVAL_FUN);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_TYPE("pcall", a, i, LVAL_QEXPR);
+  }
+
+  int err = lpar_eval_cells(e, a, 1);
+  if (err >= 0) { return lval_take(a, err); }
+
+  lval *f = lval_pop(a, 0);
+  lval *result = lval_call(e, f, a);
+  lval_del(f);
+  return result;
+}
+
+// A contiguous run of list elements handled by one task of pmap, pfilter
+// or preduce. Every call binds into its own activation frame, so all the
+// tasks share f.
+typedef struct {
+  lenv *e;
+  lval *f;
+  lval **cells;
+  int lo;
+  int hi;
+  lval *acc;
+} lpar_chunk;
+
+// Applies f to a single value
+static lval* lpar_apply(lenv *e, lval *f, lval *x) {
+  return lval_call(e, f, lval_add(lval_sexpr(), x));
+}
+
+// Replaces every element with f applied to it
+static void lpar_map_chunk(void *arg) {
+  lpar_chunk *c = arg;
+  for (int i = c->lo; i < c->hi; i++) {
+    c->cells[i] = lpar_apply(c->e, c->f, c->cells[i]);
+  }
+}
+
+// Replaces every borrowed element with f applied to a copy of it
+static void lpar_test_chunk(void *arg) {
+  lpar_chunk *c = arg;
+  for (int i = c->lo; i < c->hi; i++) {
+    c->cells[i] = lpar_apply(c->e, c->f, lval_copy(c->cells[i]));
+  }
+}
+
+// Folds the chunk from its first element, stopping at the first error
+static void lpar_reduce_chunk(void *arg) {
+  lpar_chunk *c = arg;
+  c->acc = c->cells[c->lo];
+  for (int i = c->lo + 1; i < c->hi; i++) {
+    if (c->acc->type == LVAL_ERR) {
+      lval_del(c->cells[i]);
+      continue;
+    }
+    lval *args = lval_add(lval_sexpr(), c->acc);
+    c->acc = lval_call(c->e, c->f, lval_add(args, c->cells[i]));
+  }
+}
+
+// Splits the elements of list into chunks and runs fn on each of them on
+// the thread pool. Returns the chunks, which the caller frees.
+static lpar_chunk* lpar_chunks(lenv *e, lval *f, lval *list,
+  void (*fn)(void*), int *n) {
+  // A few chunks per thread evens out lambdas of uneven cost
+  int chunks = lpool_size() * 4;
+  if (chunks > list->count) { chunks = list->count; }
+
+  lpar_chunk *c = malloc(sizeof(lpar_chunk) * (chunks ? chunks : 1));
+  ltask *tasks = malloc(sizeof(ltask) * (chunks ? chunks : 1));
+  for (int i = 0; i < chunks; i++) {
+    c[i].e = e;
+    c[i].f = f;
+    c[i].cells = list->cell;
+    c[i].lo = (int)((long)list->count * i / chunks);
+    c[i].hi = (int)((long)list->count * (i + 1) / chunks);
+    c[i].acc = NULL;
+    tasks[i].fn = fn;
+    tasks[i].arg = &c[i];
+  }
+
+  if (chunks > 1 && lpool_size() > 1) {
+    lenv_share(e);
+    lpool_run(tasks, chunks);
+    lenv_unshare(e);
+  } else {
+    for (int i = 0; i < chunks; i++) { fn(&c[i]); }
+  }
+
+  free(tasks);
+  *n = chunks;
+  return c;
+}
+
+// Returns the index of the first error in a list, or -1
+static int lpar_first_err(lval *list) {
+  for (int i = 0; i < list->count; i++) {
+    if (list->cell[i]->type == LVAL_ERR) { return i; }
+  }
+  return -1;
+}
+
+// Applies a function to every element of a list in parallel, keeping their
+// order, e.g. (pmap f {1 2 3}) gives {(f 1) (f 2) (f 3)}
+lval* builtin_pmap(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+  lval *f = lval_pop(a, 0);
+  lval *list = lval_take(a, 0);
+
+  int n;
+  free(lpar_chunks(e, f, list, lpar_map_chunk, &n));
+  lval_del(f);
+
+  int err = lpar_first_err(list);
+  return err >= 0 ? lval_take(list, err) : list;
+}
+
+// Keeps the elements of a list for which a function gives a non-zero
+// number, e.g. (pfilter f {1 2 3})
+lval* builtin_pfilter(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("pfilter", a, 2);
+  LASSERT_TYPE("pfilter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pfilter", a, 1, LVAL_QEXPR);
+
+  lval *f = lval_pop(a, 0);
+  lval *list = lval_take(a, 0);
+
+  // Test the elements where they are, through a list borrowing them. Only
+  // the argument of each call is copied, and only while it runs.
+  lval *keep = lval_qexpr();
+  keep->count = list->count;
+  keep->cell = malloc(sizeof(lval*) * (list->count ? list->count : 1));
+  for (int i = 0; i < list->count; i++) {
+    keep->cell[i] = list->cell[i];
+  }
+  int n;
+  free(lpar_chunks(e, f, keep, lpar_test_chunk, &n));
+  lval_del(f);
+
+  int err = lpar_first_err(keep);
+  if (err >= 0) {
+    lval_del(list);
+    return lval_take(keep, err);
+  }
+
+  int count = 0;
+  for (int i = 0; i < list->count; i++) {
+    lval *k = keep->cell[i];
+    int kept = (k->type == LVAL_NUM_LONG && k->num.num_long != 0)
+      || (k->type == LVAL_NUM_DOUBLE && k->num.num_double != 0);
+    if (kept) {
+      list->cell[count++] = list->cell[i];
+    } else {
+      lval_del(list->cell[i]);
+    }
+  }
+  list->count = count;
+  lval_del(keep);
+  return list;
+}
+
+// Folds a list with a function in parallel, starting from init. Chunks are
+// folded separately and then combined in order, so f should be
+// associative, e.g. (preduce + 0 {1 2 3})
+lval* builtin_preduce(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("preduce", a, 3);
+  LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+  LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+
+  lval *f = lval_pop(a, 0);
+  lval *acc = lval_pop(a, 0);
+  lval *list = lval_take(a, 0);
+
+  int n;
+  lpar_chunk *c = lpar_chunks(e, f, list, lpar_reduce_chunk, &n);
+
+  // The elements now belong to the chunk results
+  list->count = 0;
+  lval_del(list);
+
+  for (int i = 0; i < n; i++) {
+    if (acc->type == LVAL_ERR) {
+      lval_del(c[i].acc);
+      continue;
+    }
+    if (c[i].acc->type == LVAL_ERR) {
+      lval_del(acc);
+      acc = c[i].acc;
+      continue;
+    }
+    lval *args = lval_add(lval_sexpr(), acc);
+    acc = lval_call(e, f, lval_add(args, c[i].acc));
+  }
+
+  free(c);
+  lval_del(f);
+  return acc;
+}
+
+// Starts evaluating a Q-Expression on another thread and returns a future
+// for its value, e.g. (def {x} (future {f a}))
+lval* builtin_future(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("future", a, 1);
+  LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+  return lval_future(e, lval_take(a, 0));
+}
+
+// Evaluates a Q-Expression on another thread for its side effects,
+// e.g. (spawn {def {y} (f a)})
+lval* builtin_spawn(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("spawn", a, 1);
+  LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+
+  lval_spawn(e, lval_take(a, 0));
+  return lval_sexpr();
+}
+
+// Waits for the value of a future, e.g. (touch x)
+lval* builtin_touch(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("touch", a, 1);
+  LASSERT_TYPE("touch", a, 0, LVAL_FUTURE);
+
+  lval *x = lfuture_touch(a->cell[0]->future);
+  lval_del(a);
+  return x;
+}
+
+// Evaluates a Q-Expression in a coroutine, which can yield, sleep and wait
+// on channels without holding up a thread, e.g. (go {worker c})
+lval* builtin_go(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("go", a, 1);
+  LASSERT_TYPE("go", a, 0, LVAL_QEXPR);
+
+  if (lval_go(e, lval_take(a, 0)) != 0) {
+    return lval_err(LERR_MESSAGE, "Could not map a coroutine stack");
+  }
+  return lval_sexpr();
+}
+
+// Lets other coroutines run, e.g. (yield)
+lval* builtin_yield(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("yield", a, 0);
+
+  lval_del(a);
+  lcoro_yield();
+  return lval_sexpr();
+}
+
+// Suspends for a number of milliseconds, e.g. (sleep 100)
+lval* builtin_sleep(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("sleep", a, 1);
+  LASSERT_TYPE("sleep", a, 0, LVAL_NUM_LONG);
+
+  long ms = a->cell[0]->num.num_long;
+  lval_del(a);
+  lcoro_sleep(ms);
+  return lval_sexpr();
+}
+
+// Creates a channel holding up to a number of values, one by default,
+// e.g. (chan 16)
+lval* builtin_chan(lenv *e, lval *a) {
+  LASSERT(a, a->count <= 1, LERR_TOO_MANY_ARGS, a->count, 1);
+
+  long cap = 1;
+  if (a->count == 1) {
+    LASSERT_TYPE("chan", a, 0, LVAL_NUM_LONG);
+    cap = a->cell[0]->num.num_long;
+    LASSERT(a, cap > 0 && cap <= INT_MAX, LERR_MESSAGE,
+      "Channel capacity must be positive");
+  }
+
+  lval_del(a);
+  return lval_chan(cap);
+}
+
+// Sends a value, waiting while the channel is full, e.g. (send c x)
+lval* builtin_send(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("send", a, 2);
+  LASSERT_TYPE("send", a, 0, LVAL_CHAN);
+
+  lchan_send(a->cell[0]->chan, lval_pop(a, 1));
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// Receives the next value, waiting while the channel is empty, e.g. (recv c)
+lval* builtin_recv(lenv *e, lval *a) {
+  LASSERT_NUM_ARGS("recv", a, 1);
+  LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+
+  lval *x = lchan_recv(a->cell[0]->chan);
+  lval_del(a);
+  return x;
+}
+
 // Builtin for lambda function
 lval* builtin_lambda(lenv* e, lval *a) {
   // Check for two arguments, both should be of type Q-Expression
@@ -267,7 +838,7 @@ lval* builtin_lambda(lenv* e, lval *a) {
   // Check that first expression only contains symbols
   for (int i = 0; i < a->cell[0]->count; i++) {
     LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-      "Cannot define non-symbol. Got %s, expected %s.",
+      LERR_LAMBDA_NON_SYM,
       ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
   }
 
@@ -289,38 +860,89 @@ void lenv_add_builtin(lenv *e, char* name, lbuiltin func) {
   lval_del(v);
 }
 
-void lenv_add_builtins(lenv *e) {
+// Every builtin, in registration order. Images refer to builtins by their
+// index in this table rather than by address.
+const lbuiltin_def lbuiltin_table[] = {
   // List functions
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
-  lenv_add_builtin(e, "init", builtin_init);
-  lenv_add_builtin(e, "cons", builtin_cons);
-  lenv_add_builtin(e, "min", builtin_min);
-  lenv_add_builtin(e, "max", builtin_max);
-  lenv_add_builtin(e, "def", builtin_def);
+  { "list", builtin_list },
+  { "head", builtin_head },
+  { "tail", builtin_tail },
+  { "eval", builtin_eval },
+  { "join", builtin_join },
+  { "init", builtin_init },
+  { "cons", builtin_cons },
+  { "min", builtin_min },
+  { "max", builtin_max },
+  { "def", builtin_def },
 
   // Mathematical functions
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
-  lenv_add_builtin(e, "pow", builtin_pow);
-  lenv_add_builtin(e, "%", builtin_mod);
-  lenv_add_builtin(e, "add", builtin_add_full);
-  lenv_add_builtin(e, "sub", builtin_sub_full);
-  lenv_add_builtin(e, "mul", builtin_mul_full);
-  lenv_add_builtin(e, "div", builtin_div_full);
-  lenv_add_builtin(e, "print", builtin_print);
-  lenv_add_builtin(e, "exit", (lbuiltin)builtin_exit);
+  { "+", builtin_add },
+  { "-", builtin_sub },
+  { "*", builtin_mul },
+  { "/", builtin_div },
+  { "pow", builtin_pow },
+  { "%", builtin_mod },
+  { "add", builtin_add_full },
+  { "sub", builtin_sub_full },
+  { "mul", builtin_mul_full },
+  { "div", builtin_div_full },
+  { "print", builtin_print },
+  { "exit", builtin_exit },
 
   // User functions
-  lenv_add_builtin(e, "\\", builtin_lambda);
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=", builtin_put);
+  { "\\", builtin_lambda },
+  { "=", builtin_put },
+
+  // Images
+  { "save-image", builtin_save_image },
+  { "serialize", builtin_serialize },
+  { "deserialize", builtin_deserialize },
+
+  // Parallel evaluation
+  { "par", builtin_par },
+  { "pcall", builtin_pcall },
+  { "future", builtin_future },
+  { "spawn", builtin_spawn },
+  { "touch", builtin_touch },
+  { "pmap", builtin_pmap },
+  { "pfilter", builtin_pfilter },
+  { "preduce", builtin_preduce },
+
+  // Coroutines
+  { "go", builtin_go },
+  { "yield", builtin_yield },
+  { "sleep", builtin_sleep },
+  { "chan", builtin_chan },
+  { "send", builtin_send },
+  { "recv", builtin_recv },
+};
+
+const int lbuiltin_count = sizeof(lbuiltin_table) / sizeof(lbuiltin_table[0]);
+
+// Returns the index of a builtin in lbuiltin_table, or -1
+int lbuiltin_index(lbuiltin func) {
+  for (int i = 0; i < lbuiltin_count; i++) {
+    if (lbuiltin_table[i].func == func) { return i; }
+  }
+  return -1;
+}
 
+// Hashes the names in lbuiltin_table in order, so that anything referring to
+// builtins by index can tell whether it was written by a build with the same
+// table
+unsigned long lbuiltin_fingerprint(void) {
+  unsigned long h = 5381;
+  for (int i = 0; i < lbuiltin_count; i++) {
+    const char *s = lbuiltin_table[i].name;
+    do { h = h * 33 + (unsigned char)*s; } while (*s++);
+  }
+  return h & 0xffffffff;
+}
+
+void lenv_add_builtins(lenv *e) {
+  for (int i = 0; i < lbuiltin_count; i++) {
+    lenv_add_builtin(e, lbuiltin_table[i].name, lbuiltin_table[i].func);
+  }
 }
 
 // Constructs an lval that contains an integer data type
@@ -339,33 +961,170 @@ lval* lval_num_double(double x) {
   return v;
 }
 
-// Constructs an lval for when an error has been encountered
-lval* lval_err(char* fmt, ...) {
+// Error messages indexed by error code. Arguments are stored with the error
+// and only formatted when it is printed, so errors that are caught and
+// discarded never pay for the message. 'args' gives the kind of each
+// argument in order, 's' for a string, 'i' for an int and 'l' for a long.
+// 'owned' is the index of a string argument that may not outlive the caller
+// and is copied into the error.
+static const struct {
+  const char* fmt;
+  const char* args;
+  int owned;
+} lerr_table[LERR_COUNT] = {
+  [LERR_DIV_ZERO]       = { "Divison by zero.", "", -1 },
+  [LERR_BAD_OP]         = { "Invalid operator '%s'.", "s", -1 },
+  [LERR_BAD_NUM]        = { "invalid number", "", -1 },
+  [LERR_MOD_FLOAT]      = { "Non-integer modulo.", "", -1 },
+  [LERR_BAD_TYPE]       = { "Function %s passeed incorrect type for argument %i. "
+                            "Got %s, expected %s.", "siss", -1 },
+  [LERR_NOT_NUM]        = { "Function %s passed incorrect type for argument %d. "
+                            "Got %s, expected Number.", "sis", -1 },
+  [LERR_EMPTY_ARG]      = { "Function %s passed empty expression for argument %d.",
+                            "si", -1 },
+  [LERR_NUM_ARGS]       = { "Function %s passed incorrect number of arguments. "
+                            "Got %d, expected %d.", "sii", -1 },
+  [LERR_UNBOUND_SYM]    = { "Unbound Symbol '%s'", "s", 0 },
+  [LERR_SEXPR_START]    = { "S-Expression starts with incorrect type. "
+                            "Got %s, expected %s.", "ss", -1 },
+  [LERR_TOO_MANY_ARGS]  = { "Function passed too many arguments. "
+                            "Got %d, expected %d.", "ii", -1 },
+  [LERR_BAD_VARARGS]    = { "Function format invalid. "
+                            "Symbol '&' not followed by single symbol.", "", -1 },
+  [LERR_DEF_NON_SYM]    = { "Function '%s' cannot define non-symbol. "
+                            "Got %s, expected %s.", "sss", -1 },
+  [LERR_DEF_COUNT]      = { "Function '%s' passed too many arguments for symobls. "
+                            "Got %d, expected %d.", "sii", -1 },
+  [LERR_LAMBDA_NON_SYM] = { "Cannot define non-symbol. Got %s, expected %s.",
+                            "ss", -1 },
+  [LERR_PARSE_UNEXPECTED] = { "%s:%d:%d: error: unexpected '%c'", "siii", 0 },
+  [LERR_PARSE_EOF]      = { "%s:%d:%d: error: expected '%c' at end of input",
+                            "siii", 0 },
+  [LERR_MESSAGE]        = { "%s", "s", 0 },
+  [LERR_IMAGE_WRITE]    = { "Could not write image '%s'", "s", 0 },
+  [LERR_FILE_WRITE]     = { "Could not write '%s'", "s", 0 },
+  [LERR_FILE_READ]      = { "Could not read a value from '%s'", "s", 0 },
+  [LERR_EXIT]           = { "Exit requested", "", -1 },
+  [LERR_BAD_PATH]       = { "Function %s passed incorrect path for argument %d. "
+                            "Expected a single path symbol.", "si", -1 },
+};
+
+// Walks an error format and returns the conversion character of the next
+// argument, leaving *fmt just past it. Returns '\0' at the end.
+static char lerr_next_conv(const char **fmt, const char **spec) {
+  const char *f = *fmt;
+  while (*f && (*f != '%' || f[1] == '%')) {
+    f += (*f == '%') ? 2 : 1;
+  }
+  if (!*f) { *fmt = f; return '\0'; }
+  *spec = f++;
+  while (*f && !strchr("dics", *f)) { f++; }
+  *fmt = *f ? f + 1 : f;
+  return *f;
+}
+
+// Copies the string argument of an error that may not outlive the caller
+static void lval_err_own(lval *v) {
+  int owned = lerr_table[v->err].owned;
+  if (owned >= 0) {
+    const char *s = v->err_args[owned].s;
+    char *c = malloc(strlen(s) + 1);
+    strcpy(c, s);
+    v->err_args[owned].s = c;
+  }
+}
+
+// Constructs an lval for when an error has been encountered.
+// Only the error code and its arguments are stored.
+lval* lval_err(int code, ...) {
   lval *v = malloc(sizeof(lval));
   v->type = LVAL_ERR;
+  v->err = code;
 
-  // Create a new va list and initialize
+  // Collect the arguments by their kinds
   va_list va;
-  va_start(va, fmt);
+  va_start(va, code);
+  const char *k = lerr_table[code].args;
+  for (int n = 0; k[n] && n < LERR_MAX_ARGS; n++) {
+    switch (k[n]) {
+      case 's': v->err_args[n].s = va_arg(va, const char*); break;
+      case 'l': v->err_args[n].i = va_arg(va, long); break;
+      default:  v->err_args[n].i = va_arg(va, int); break;
+    }
+  }
+  va_end(va);
 
-  // Allocate 512 bytes of space
-  v->num.err = malloc(512);
+  lval_err_own(v);
+  return v;
+}
 
-  // printf the error
-  vsnprintf(v->num.err, 511, fmt, va);
+// Formats the message of an error lval into buf, like snprintf.
+// Returns the length of the full message.
+int lval_err_string(lval *v, char *buf, int size) {
+  const char *fmt = lerr_table[v->err].fmt, *start = fmt, *spec;
+  char conv, one[16];
+  int n = 0, len = 0;
+
+  #define LERR_APPEND(...) \
+    len += snprintf(buf + (len < size ? len : size), \
+      len < size ? size - len : 0, __VA_ARGS__)
+
+  while ((conv = lerr_next_conv(&fmt, &spec))) {
+    // Literal text up to the conversion
+    LERR_APPEND("%.*s", (int)(spec - start), start);
+
+    // Format the single conversion with its own spec
+    int sl = fmt - spec < (int)sizeof(one) ? fmt - spec : sizeof(one) - 1;
+    memcpy(one, spec, sl);
+    one[sl] = '\0';
+    if (conv == 's') {
+      LERR_APPEND(one, v->err_args[n].s);
+    } else if (strchr(one, 'l')) {
+      LERR_APPEND(one, v->err_args[n].i);
+    } else {
+      LERR_APPEND(one, (int)v->err_args[n].i);
+    }
+    n++;
+    start = fmt;
+  }
+  LERR_APPEND("%s", start);
 
-  // Cleanup
-  va_end(va);
+  #undef LERR_APPEND
+  return len;
+}
 
-  return v;
+// Formats the message of an error lval onto the end of a buffer
+void lval_err_write(lbuf *b, lval *v) {
+  lbuf_reserve(b, 512);
+  int n = lval_err_string(v, b->data + b->len, b->slots - b->len);
+  if ((size_t)n >= b->slots - b->len) {
+    lbuf_reserve(b, n + 1);
+    lval_err_string(v, b->data + b->len, b->slots - b->len);
+  }
+  b->len += n;
+}
+
+// Formats and prints the message of an error lval
+void lval_err_print(lval *v) {
+  lbuf b;
+  lbuf_init(&b);
+  lval_err_write(&b, v);
+  fwrite(b.data, 1, b.len, stdout);
+  lbuf_free(&b);
 }
 
 // Construct a new symbol lval
 lval* lval_sym(char* s) {
+  return lval_sym_n(s, strlen(s));
+}
+
+// Construct a new symbol lval from the first n characters of s
+lval* lval_sym_n(const char* s, size_t n) {
   lval *v = malloc(sizeof(lval));
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->sym = malloc(n + 1);
+  memcpy(v->sym, s, n);
+  v->sym[n] = '\0';
   return v;
 }
 
@@ -396,7 +1155,9 @@ lval* lval_fun(lbuiltin func) {
 }
 
 // Copies an lval and returns the copied version
-lval* lval_copy(lval *v) {
+// Copies one lval. The cells of a copied list still point at the original's
+// children, for lval_copy to replace.
+static lval* lval_copy_node(lval *v) {
   lval *x = malloc(sizeof(lval));
   x->type = v->type;
 
@@ -418,29 +1179,62 @@ lval* lval_copy(lval *v) {
       }
       break;
     case LVAL_ERR:
-      x->num.err = malloc(sizeof(strlen(v->num.err) + 1));
-      strcpy(x->num.err, v->num.err);
+      x->err = v->err;
+      memcpy(x->err_args, v->err_args, sizeof(x->err_args));
+      lval_err_own(x);
       break;
     case LVAL_SYM:
-      x->sym = malloc(sizeof(strlen(v->sym) + 1));
+      x->sym = malloc(strlen(v->sym) + 1);
       strcpy(x->sym, v->sym);
       break;
+    case LVAL_FUTURE:
+      x->future = v->future;
+      lfuture_ref(x->future);
+      break;
+    case LVAL_CHAN:
+      x->chan = v->chan;
+      lchan_ref(x->chan);
+      break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
       x->cell = malloc(sizeof(lval*) * x->count);
-      for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
+      if (x->count) {
+        memcpy(x->cell, v->cell, sizeof(lval*) * x->count);
       }
       break;
   }
   return x;
 }
 
+// Copies an lval, going through nested lists with a stack of the copies
+// whose children are still shared
+lval* lval_copy(lval *v) {
+  lval *x = lval_copy_node(v);
+  if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return x; }
+
+  lstack s;
+  lstack_init(&s);
+  lstack_push(&s, x);
+  while (s.count) {
+    lval *l = s.items[--s.count];
+    for (int i = 0; i < l->count; i++) {
+      lval *c = l->cell[i] = lval_copy_node(l->cell[i]);
+      if ((c->type == LVAL_SEXPR || c->type == LVAL_QEXPR) && c->count) {
+        lstack_push(&s, c);
+      }
+    }
+  }
+  lstack_free(&s);
+  return x;
+}
+
 // Creates a new environment
 lenv* lenv_new(void) {
   lenv *e = malloc(sizeof(lenv));
   e->par = NULL;
+  e->interp = NULL;
+  e->shared = 0;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
@@ -462,6 +1256,8 @@ void lenv_del(lenv *e) {
 lenv* lenv_copy(lenv *e) {
   lenv *a = malloc(sizeof(lenv));
   a->par = e->par;
+  a->interp = e->interp;
+  a->shared = 0;
   a->count = e->count;
   a->syms = malloc(sizeof(char*) * a->count);
   a->vals = malloc(sizeof(lval*) * a->count);
@@ -474,8 +1270,107 @@ lenv* lenv_copy(lenv *e) {
   return a;
 }
 
-// Retrieve a value from an environment
-lval* lenv_get(lenv *e, lval *k) {
+// Marks e and every environment above it as shared between threads until
+// the matching lenv_unshare. Only the thread that owns an environment can
+// hand it out, so one that isn't marked is read and updated without a lock.
+void lenv_share(lenv *e) {
+  for (; e; e = e->par) {
+    __atomic_add_fetch(&e->shared, 1, __ATOMIC_RELEASE);
+  }
+}
+
+void lenv_unshare(lenv *e) {
+  for (; e; e = e->par) {
+    __atomic_sub_fetch(&e->shared, 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Returns the interpreter whose lock guards e, or NULL when e isn't shared
+static interp_t* lenv_lock(lenv *e) {
+  if (!__atomic_load_n(&e->shared, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return e->interp;
+}
+
+// Slot of the calling thread in every interpreter's reader counts
+static __thread int lenv_slot_self = -1;
+static atomic_int lenv_slot_next = 0;
+
+// Counts the calling thread as a reader of in's shared environments. Each
+// thread counts itself in its own slot, so readers on different threads
+// don't write to a common cache line.
+static atomic_int* lenv_read_lock(interp_t *in) {
+  if (lenv_slot_self < 0) {
+    lenv_slot_self = atomic_fetch_add(&lenv_slot_next, 1) % LENV_SLOTS;
+  }
+  atomic_int *r = &in->slots[lenv_slot_self].readers;
+  for (;;) {
+    atomic_fetch_add(r, 1);
+    if (!atomic_load(&in->writing)) { return r; }
+    // Get out of the way of the writer waiting for readers to leave
+    atomic_fetch_sub(r, 1);
+    while (atomic_load_explicit(&in->writing, memory_order_relaxed)) {
+      sched_yield();
+    }
+  }
+}
+
+static void lenv_read_unlock(atomic_int *r) {
+  atomic_fetch_sub_explicit(r, 1, memory_order_release);
+}
+
+// Waits until no thread reads in's shared environments, and keeps new
+// readers out until lenv_write_unlock
+static void lenv_write_lock(interp_t *in) {
+  pthread_mutex_lock(&in->write_lock);
+  atomic_store(&in->writing, 1);
+  for (int i = 0; i < LENV_SLOTS; i++) {
+    while (atomic_load(&in->slots[i].readers)) { sched_yield(); }
+  }
+}
+
+static void lenv_write_unlock(interp_t *in) {
+  atomic_store_explicit(&in->writing, 0, memory_order_release);
+  pthread_mutex_unlock(&in->write_lock);
+}
+
+// Copies every binding visible from e, other than the global ones, into a
+// single environment whose parent is the global environment. Code running
+// on another thread can use it after the function that owns e returns.
+lenv* lenv_capture(lenv *e) {
+  lenv *x = lenv_new();
+  x->interp = e->interp;
+  interp_t *in = NULL;
+  atomic_int *r = NULL;
+  for (; e->par; e = e->par) {
+    // Everything above a shared environment is shared too
+    if (!in && (in = lenv_lock(e))) { r = lenv_read_lock(in); }
+
+    for (int i = 0; i < e->count; i++) {
+      // Inner bindings shadow outer ones
+      int found = 0;
+      for (int j = 0; j < x->count && !found; j++) {
+        found = strcmp(x->syms[j], e->syms[i]) == 0;
+      }
+      if (found) { continue; }
+
+      x->count++;
+      x->syms = realloc(x->syms, sizeof(char*) * x->count);
+      x->vals = realloc(x->vals, sizeof(lval*) * x->count);
+      x->syms[x->count - 1] = malloc(strlen(e->syms[i]) + 1);
+      strcpy(x->syms[x->count - 1], e->syms[i]);
+      x->vals[x->count - 1] = lval_copy(e->vals[i]);
+    }
+  }
+  x->par = e;
+
+  if (r) { lenv_read_unlock(r); }
+  return x;
+}
+
+// Returns a copy of the value bound to k in e itself, or NULL
+static lval* lenv_lookup(lenv *e, lval *k) {
   // Iterate over all the items in the environment
   for (int i = 0; i < e->count; i++) {
     // Check if the stored string matches the symbol string
@@ -484,27 +1379,42 @@ lval* lenv_get(lenv *e, lval *k) {
       return lval_copy(e->vals[i]);
     }
   }
+  return NULL;
+}
 
-  // If no symbol, check in parent
-  if (e->par) {
-    return lenv_get(e->par, k);
+// Retrieve a value from an environment
+lval* lenv_get(lenv *e, lval *k) {
+  // Frames private to this thread come first and need no lock
+  interp_t *in = NULL;
+  for (; e && !(in = lenv_lock(e)); e = e->par) {
+    lval *x = lenv_lookup(e, k);
+    if (x) { return x; }
   }
-  // Otherwise return an error.
-  else {
-    return lval_err("Unbound Symbol '%s'", k->sym);
+
+  if (e) {
+    atomic_int *r = lenv_read_lock(in);
+    for (; e; e = e->par) {
+      lval *x = lenv_lookup(e, k);
+      if (x) {
+        lenv_read_unlock(r);
+        return x;
+      }
+    }
+    lenv_read_unlock(r);
   }
+  return lval_err(LERR_UNBOUND_SYM, k->sym);
 }
 
-// Insert a variable into the environment
-void lenv_put(lenv *e, lval *k, lval *v) {
+// Binds k to v in e, taking ownership of v
+static void lenv_insert(lenv *e, lval *k, lval *v) {
   // Iterate over all the items in the environment
   for (int i = 0; i < e->count; i++) {
     // Check if the stored string matches the symbol string
     // If a match is found, replace the value by deleting that
-    // element and inserting a new, updated value.
+    // element and inserting the new one.
     if (strcmp(e->syms[i], k->sym) == 0) {
       lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
+      e->vals[i] = v;
       return;
     }
   }
@@ -515,11 +1425,30 @@ void lenv_put(lenv *e, lval *k, lval *v) {
   e->vals = realloc(e->vals, sizeof(lval*) * e->count);
   e->syms = realloc(e->syms, sizeof(lenv*) * e->count);
 
-  e->vals[e->count - 1] = lval_copy(v);
+  e->vals[e->count - 1] = v;
   e->syms[e->count - 1] = malloc(strlen(k->sym)+1);
   strcpy(e->syms[e->count - 1], k->sym);
 }
 
+// Insert a variable into the environment, taking ownership of v
+void lenv_move(lenv *e, lval *k, lval *v) {
+  interp_t *in = lenv_lock(e);
+  if (!in) {
+    lenv_insert(e, k, v);
+    return;
+  }
+
+  lenv_write_lock(in);
+  lenv_insert(e, k, v);
+  lenv_write_unlock(in);
+}
+
+// Insert a copy of a variable into the environment
+void lenv_put(lenv *e, lval *k, lval *v) {
+  // Copy outside the lock
+  lenv_move(e, k, lval_copy(v));
+}
+
 // Takes an lval as input and returns the first argument in the list, discarding
 // the rest.
 lval* builtin_head(lenv *e, lval *v) {
@@ -633,19 +1562,25 @@ char* ltype_name(int t) {
       return "S-Expression";
     case LVAL_SYM:
       return "Symbol";
+    case LVAL_FUTURE:
+      return "Future";
+    case LVAL_CHAN:
+      return "Channel";
     default:
       return "Unknown";
   }
 }
 
-// Delete an lval
-void lval_del(lval *v) {
+// Frees one lval, pushing the lvals it holds onto s to be deleted next
+static void lval_free(lval *v, lstack *s) {
   switch (v->type) {
     case LVAL_NUM_LONG:
     case LVAL_NUM_DOUBLE:
       break;
     case LVAL_ERR:
-      free(v->num.err);
+      if (lerr_table[v->err].owned >= 0) {
+        free((char*)v->err_args[lerr_table[v->err].owned].s);
+      }
       break;
     case LVAL_SYM:
       free(v->sym);
@@ -653,32 +1588,56 @@ void lval_del(lval *v) {
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
+        lstack_push(s, v->cell[i]);
       }
       free(v->cell);
       break;
     case LVAL_FUN:
       if (!v->builtin) {
         lenv_del(v->env);
-        lval_del(v->formals);
-        lval_del(v->body);
+        lstack_push(s, v->formals);
+        lstack_push(s, v->body);
       }
       break;
+    case LVAL_FUTURE:
+      lfuture_unref(v->future);
+      break;
+    case LVAL_CHAN:
+      lchan_unref(v->chan);
+      break;
     default:
       break;
   }
   free(v);
 }
 
+// Delete an lval. Children waiting to be deleted go on a stack rather than
+// being deleted recursively.
+void lval_del(lval *v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR &&
+    v->type != LVAL_FUN) {
+    lval_free(v, NULL);
+    return;
+  }
+
+  lstack s;
+  lstack_init(&s);
+  lstack_push(&s, v);
+  while (s.count) {
+    lval_free(s.items[--s.count], &s);
+  }
+  lstack_free(&s);
+}
+
 // Reads input from the AST and returns an lval of the correct data type
 lval* lval_read_num(mpc_ast_t *t) {
   errno = 0;
   if (strstr(t->contents, ".")) {
     double x = strtod(t->contents, NULL);
-    return errno != ERANGE ? lval_num_double(x) : lval_err("invalid number");
+    return errno != ERANGE ? lval_num_double(x) : lval_err(LERR_BAD_NUM);
   } else {
     long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num_long(x) : lval_err("invalid number");
+    return errno != ERANGE ? lval_num_long(x) : lval_err(LERR_BAD_NUM);
   }
 
 }
@@ -716,61 +1675,118 @@ lval* lval_add(lval *v, lval *x) {
   return v;
 }
 
-// Print an expression
-void lval_expr_print(lval *v, char open, char close) {
-  putchar(open);
-
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
-
-    if (i != (v->count-1)) {
-        printf(" ");
-    }
-  }
-  putchar(close);
-}
-
-// Print an "lval"
-void lval_print(lval *v) {
+// Writes an lval that holds no others, or the opening of one that does
+static void lval_write_atom(lbuf *b, lval *v) {
   switch(v->type) {
     case LVAL_NUM_LONG:
-      printf("%li", v->num.num_long);
+      lbuf_put_long(b, v->num.num_long);
       break;
     case LVAL_NUM_DOUBLE:
-      printf("%g", v->num.num_double);
+      lbuf_put_double(b, v->num.num_double);
       break;
     case LVAL_ERR:
-      printf("Error: %s", v->num.err);
+      lbuf_puts(b, "Error: ");
+      lval_err_write(b, v);
       break;
     case LVAL_SYM:
-      printf("%s", v->sym);
+      lbuf_puts(b, v->sym);
       break;
     case LVAL_SEXPR:
-      lval_expr_print(v, '(', ')');
+      lbuf_putc(b, '(');
       break;
     case LVAL_QEXPR:
-      lval_expr_print(v, '{', '}');
+      lbuf_putc(b, '{');
       break;
     case LVAL_FUN:
-      if (v->builtin) {
-        printf("<builtin>");
-      } else {
-        printf("(\\ ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
-      }
+      lbuf_puts(b, v->builtin ? "<builtin>" : "(\\ ");
+      break;
+    case LVAL_FUTURE:
+      lbuf_puts(b, "<future>");
+      break;
+    case LVAL_CHAN:
+      lbuf_puts(b, "<chan>");
       break;
     default:
       break;
   }
 }
 
+// A list or lambda being written, and the part of it to write next
+typedef struct {
+  lval *v;
+  int next;
+} lwrite_frame;
+
+// Write an "lval" to the end of a buffer. Lists and lambdas that have been
+// opened but not closed yet are kept on a stack.
+void lval_write(lbuf *b, lval *v) {
+  lwrite_frame local[LSTACK_INLINE];
+  lwrite_frame *stack = local;
+  int slots = LSTACK_INLINE;
+  int n = 0;
+
+  while (v) {
+    int open = v->type == LVAL_SEXPR || v->type == LVAL_QEXPR ||
+      (v->type == LVAL_FUN && !v->builtin);
+    if (open) {
+      if (n == slots) {
+        stack = lstack_grow(stack, local, &slots, sizeof(lwrite_frame));
+      }
+      stack[n++] = (lwrite_frame){ v, 0 };
+    }
+    lval_write_atom(b, v);
+
+    // Close everything finished and find the next part to write
+    v = NULL;
+    while (n && !v) {
+      lwrite_frame *top = &stack[n - 1];
+      lval *l = top->v;
+      if (l->type == LVAL_FUN) {
+        if (top->next < 2) {
+          v = top->next ? l->body : l->formals;
+          if (top->next++) { lbuf_putc(b, ' '); }
+          continue;
+        }
+      } else if (top->next < l->count) {
+        if (top->next) { lbuf_putc(b, ' '); }
+        v = l->cell[top->next++];
+        continue;
+      }
+      lbuf_putc(b, l->type == LVAL_QEXPR ? '}' : ')');
+      n--;
+    }
+  }
+
+  if (stack != local) { free(stack); }
+}
+
+// Print an "lval". The whole value is formatted first and written to
+// stdout at once.
+void lval_print(lval *v) {
+  lbuf b;
+  lbuf_init(&b);
+  lval_write(&b, v);
+  fwrite(b.data, 1, b.len, stdout);
+  lbuf_free(&b);
+}
+
 // Print a new line
 void lval_println(lval *v) {
-  lval_print(v);
-  printf("\n");
+  lbuf b;
+  lbuf_init(&b);
+  lval_write(&b, v);
+  lbuf_putc(&b, '\n');
+  fwrite(b.data, 1, b.len, stdout);
+  lbuf_free(&b);
+}
+
+// Returns the printed form of an "lval" as a string the caller frees
+char* lval_to_string(lval *v) {
+  lbuf b;
+  lbuf_init(&b);
+  lval_write(&b, v);
+  lbuf_putc(&b, '\0');
+  return b.data;
 }
 
 // Calculate the number of leaves on an AST
@@ -807,9 +1823,15 @@ int numBranches(mpc_ast_t *t) {
 
 // Prints all elements in a given environment
 lval* lenv_print(lenv *e) {
+  lbuf b;
+  lbuf_init(&b);
   for (int i = 0; i < e->count; i++) {
-    printf("Key: %s\n", e->syms[i]);
+    lbuf_puts(&b, "Key: ");
+    lbuf_puts(&b, e->syms[i]);
+    lbuf_putc(&b, '\n');
   }
+  interp_write(e->interp, b.data, b.len);
+  lbuf_free(&b);
   return lval_sexpr();
 }
 
@@ -847,14 +1869,12 @@ lval* builtin_var(lenv *e, lval *a, char* func) {
   lval *syms = a->cell[0];
   for (int i = 0; i < syms->count; i++) {
     LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-      "Function '%s' cannot define non-symbol. "
-      "Got %s, expected %s.",
+      LERR_DEF_NON_SYM,
       func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
   }
 
   LASSERT(a, (syms->count == a->count - 1),
-    "Function '%s' passed too many arguments for symobls. "
-    "Got %d, expected %d.",
+    LERR_DEF_COUNT,
     func, syms->count, a->count - 1);
 
   for (int i = 0; i < syms->count; i++) {
@@ -872,144 +1892,170 @@ lval* builtin_var(lenv *e, lval *a, char* func) {
   return lval_sexpr();
 }
 
-// Call a function
-lval* lval_call(lenv *e, lval *f, lval *a) {
-  // If builtin then simply apply that
-  if (f->builtin) {
-    return f->builtin(e, a);
-  }
-
-  // Record argument counts
-  int given = a->count;
+// Binds the arguments of a lambda call. Returns NULL once every formal is
+// bound, with the activation frame to evaluate the body in in *frame.
+// Otherwise returns an error or the partially applied function.
+static lval* lval_bind(lenv *e, lval *f, lval *a, lenv **frame_out) {
+  // Bind into a new activation frame rather than into f, so the same
+  // function can be called from several threads at once. The frame is
+  // private to this call and doesn't need lenv_put's locking.
+  lenv *frame = lenv_copy(f->env);
+  lval **formals = f->formals->cell;
   int total = f->formals->count;
+  int given = a->count;
+  int next = 0;
 
   // While arguments remain to be processed
   while(a->count) {
-    if (f->formals->count == 0) {
+    if (next == total) {
+      lenv_del(frame);
       lval_del(a);
-      return lval_err("Function passed too many arguments. "
-        "Got %d, expected %d.", given, total);
+      return lval_err(LERR_TOO_MANY_ARGS, given, total);
     }
-    // Pop first symbol
-    lval *sym = lval_pop(f->formals, 0);
+    // Take the next symbol
+    lval *sym = formals[next++];
 
     // Special case to deal with '&'
     if (strcmp(sym->sym, "&") == 0) {
       // Ensure it is followed by another symobl
-      if (f->formals->count != 1) {
+      if (total - next != 1) {
+        lenv_del(frame);
         lval_del(a);
-        return lval_err("Function format invalid. "
-          "Symbol '&' not followe by single symobl.");
+        return lval_err(LERR_BAD_VARARGS);
       }
 
       // Next formal should be bound to remaining arguments
-      lval *nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(nsym);
+      lval *nsym = formals[next++];
+      lenv_insert(frame, nsym, builtin_list(e, a));
+      a = NULL;
       break;
     }
 
-    // Pop the next argument
-    lval *val = lval_pop(a, 0);
-
-    // Bind a copy into the function environment
-    lenv_put(f->env, sym, val);
-
-    // Delete syumobld and value
-    lval_del(sym);
-    lval_del(val);
+    // Pop the next argument and move it into the frame
+    lenv_insert(frame, sym, lval_pop(a, 0));
   }
 
   // List is now bound, clean up
-  lval_del(a);
+  if (a) { lval_del(a); }
 
   // If '&' remians in formal list bind to empty list
-  if (f->formals->count > 0 &&
-    strcmp(f->formals->cell[0]->sym, "&") == 0) {
+  if (next < total && strcmp(formals[next]->sym, "&") == 0) {
 
     // Check to ensure that & is not passed invalidly
-    if (f->formals->count != 2) {
-      return lval_err("Function format invalid. "
-        "Symbol '&' not followed by single symbol.");
+    if (total - next != 2) {
+      lenv_del(frame);
+      return lval_err(LERR_BAD_VARARGS);
     }
 
-    // Pop and delete '&'
-    lval_del(lval_pop(f->formals, 0));
-
-    // Pop next symbol and create an empy list
-    lval *sym = lval_pop(f->formals, 0);
-    lval *val = lval_qexpr();
-
-    // Bind and delete
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+    // Skip '&' and bind the next symbol to an empty list
+    lenv_insert(frame, formals[next + 1], lval_qexpr());
+    next += 2;
   }
 
   // If all formals havev been bound, evaluate
-  if (f->formals->count == 0) {
+  if (next == total) {
     // Set environment parent to eval environment
-    f->env->par = e;
+    frame->par = e;
+    frame->interp = e->interp;
 
-    // Eval and return
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    // Otherwise return partially evaluated function
-    return lval_copy(f);
-  }
-}
-
-int main(int argc, char** argv) {
-
-  // Create some parsers
-  mpc_parser_t *Number = mpc_new("number");
-  mpc_parser_t *Symbol = mpc_new("symbol");
-  mpc_parser_t *Sexpr = mpc_new("sexpr");   // Symbolic Expression
-  mpc_parser_t *Qexpr = mpc_new("qexpr");   // Quoted Expression (Macros)
-  mpc_parser_t *Expr = mpc_new("expr");
-  mpc_parser_t *Lispy = mpc_new("lispy");
-
-  // Define them with the following language
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                         \
-      number : /-?[0-9]+(\\.[0-9])*/;                         \
-      symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;             \
-      sexpr  : '(' <expr>* ')' ;                              \
-      qexpr  : '{' <expr>* '}' ;                              \
-      expr   : <number> | <symbol> | <sexpr> | <qexpr> ;      \
-      lispy  : /^/ <expr>* /$/ ;                              \
-    ",
-    Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-
-  printf("Lisp version 0.0.0.1\n");
-  printf("Type Ctrl-C or 'exit' to exit\n");
-
-  lenv *e = lenv_new();
-  lenv_add_builtins(e);
-
-  while(1) {
-    char *input = readline("Lisp> ");
-
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      // On success print the result of the evaluation
-      lval *x = lval_eval(e, lval_read(r.output));
-      lval_println(x);
-      lval_del(x);
-      mpc_ast_delete(r.output);
-    } else {
-      // Otherwise print the error
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
-    }
-    add_history(input);
-    free(input);
+    *frame_out = frame;
+    return NULL;
   }
 
-  // Undefine and delete our parsers
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  // Otherwise return partially evaluated function
+  lval *rest = lval_qexpr();
+  for (int i = next; i < total; i++) {
+    lval_add(rest, lval_copy(formals[i]));
+  }
+  lval *x = lval_lambda(rest, lval_copy(f->body));
+  lenv_del(x->env);
+  x->env = frame;
+  return x;
+}
+
+// Call a function
+lval* lval_call(lenv *e, lval *f, lval *a) {
+  // If builtin then simply apply that
+  if (f->builtin) {
+    return f->builtin(e, a);
+  }
+
+  lenv *frame;
+  lval *x = lval_bind(e, f, a, &frame);
+  if (x) { return x; }
+
+  // Eval and return
+  lval *body = lval_copy(f->body);
+  body->type = LVAL_SEXPR;
+  x = lval_eval(frame, body);
+  lenv_del(frame);
+  return x;
+}
+
+// A token of the lispy grammar, tagged like mpca_lang tags its tokens
+static mpc_parser_t* lispy_tok(mpc_parser_t *a, const char *tag) {
+  return mpca_state(mpca_tag(mpc_apply(mpc_tok(a), mpcf_str_ast), tag));
+}
+
+// A reference to another rule, tagged with the rule's name
+static mpc_parser_t* lispy_ref(mpc_parser_t *p, const char *name) {
+  return mpca_state(mpca_root(mpca_add_tag(p, name)));
+}
+
+// An anchor that outputs an empty string, as /^/ and /$/ do
+static mpc_parser_t* lispy_anchor(mpc_parser_t *a) {
+  return lispy_tok(mpc_and(2, mpcf_snd, a, mpc_lift(mpcf_ctor_str), mpcf_dtor_null), "regex");
+}
 
-  lenv_del(e);
-  return 0;
+// Defines the lispy grammar straight from combinators. The ASTs are the same
+// as for the following mpca_lang grammar, but no grammar or regex compilation
+// happens at startup.
+//
+//   number : /-?[0-9]+(\.[0-9]+)?/ ;
+//   symbol : /[a-zA-Z0-9_+\-*\/\\=<>!&]+/ ;
+//   sexpr  : '(' <expr>* ')' ;
+//   qexpr  : '{' <expr>* '}' ;
+//   expr   : <number> | <symbol> | <sexpr> | <qexpr> ;
+//   lispy  : /^/ <expr>* /$/ ;
+void lispy_grammar(mpc_parser_t *Number, mpc_parser_t *Symbol,
+  mpc_parser_t *Sexpr, mpc_parser_t *Qexpr, mpc_parser_t *Expr,
+  mpc_parser_t *Lispy) {
+
+  mpc_define(Number, lispy_tok(mpc_and(3, mpcf_strfold,
+    mpc_maybe_lift(mpc_char('-'), mpcf_ctor_str),
+    mpc_many1(mpcf_strfold, mpc_range('0', '9')),
+    mpc_maybe_lift(mpc_and(2, mpcf_strfold,
+      mpc_char('.'), mpc_many1(mpcf_strfold, mpc_range('0', '9')), free),
+      mpcf_ctor_str),
+    free, free), "regex"));
+
+  mpc_define(Symbol, lispy_tok(mpc_many1(mpcf_strfold,
+    mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+              "0123456789_+-*/\\=<>!&")), "regex"));
+
+  mpc_define(Sexpr, mpca_and(3,
+    lispy_tok(mpc_char('('), "char"),
+    mpca_many(lispy_ref(Expr, "expr")),
+    lispy_tok(mpc_char(')'), "char")));
+
+  mpc_define(Qexpr, mpca_and(3,
+    lispy_tok(mpc_char('{'), "char"),
+    mpca_many(lispy_ref(Expr, "expr")),
+    lispy_tok(mpc_char('}'), "char")));
+
+  mpc_define(Expr, mpca_or(4,
+    lispy_ref(Number, "number"), lispy_ref(Symbol, "symbol"),
+    lispy_ref(Sexpr, "sexpr"), lispy_ref(Qexpr, "qexpr")));
+
+  mpc_define(Lispy, mpca_and(3,
+    lispy_anchor(mpc_soi()),
+    mpca_many(lispy_ref(Expr, "expr")),
+    lispy_anchor(mpc_eoi())));
+
+  mpc_optimise(Number);
+  mpc_optimise(Symbol);
+  mpc_optimise(Sexpr);
+  mpc_optimise(Qexpr);
+  mpc_optimise(Expr);
+  mpc_optimise(Lispy);
 }
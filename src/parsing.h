@@ -2,12 +2,21 @@
 #define parsing_h
 
 #include "mpc.h"
+#include "buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // Forward Declarations
 struct lval;
 struct lenv;
+struct lfuture;
+struct lchan;
+struct interp;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct interp interp_t;
 
 // Lisp Values
 enum {
@@ -17,82 +26,148 @@ enum {
   LVAL_SYM,
   LVAL_FUN,
   LVAL_SEXPR,
-  LVAL_QEXPR
+  LVAL_QEXPR,
+  LVAL_FUTURE,
+  LVAL_CHAN
 };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
-// Value struct
+// Registry of builtins
+typedef struct {
+  char* name;
+  lbuiltin func;
+} lbuiltin_def;
+
+extern const lbuiltin_def lbuiltin_table[];
+extern const int lbuiltin_count;
+int lbuiltin_index(lbuiltin func);
+unsigned long lbuiltin_fingerprint(void);
+
+// Maximum number of arguments an error message can carry
+#define LERR_MAX_ARGS 4
+
+// Error argument, either an integer or a string that outlives the error
+typedef union {
+  long i;
+  const char* s;
+} lerr_arg;
+
+// Value struct. Only the fields of a value's own type are ever set, so
+// the payloads of the different types share storage.
 struct lval {
   int type;
 
-  // Basics
   union {
-    long num_long;
-    double num_double;
-    char* err;
-  } num;
-  char* sym;
-
-  // Function
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
-
-  // Expression
-  int count;
-  struct lval **cell;
+    // Basics
+    union {
+      long num_long;
+      double num_double;
+    } num;
+    char* sym;
+
+    // Error, the message is only formatted when printed
+    struct {
+      int err;
+      lerr_arg err_args[LERR_MAX_ARGS];
+    };
+
+    // Function
+    struct {
+      lbuiltin builtin;
+      lenv* env;
+      lval* formals;
+      lval* body;
+    };
+
+    // Future, shared between copies
+    struct lfuture *future;
+
+    // Channel, shared between copies
+    struct lchan *chan;
+
+    // Expression
+    struct {
+      int count;
+      struct lval **cell;
+    };
+  };
 };
 
 // Enviornment struct
 struct lenv {
   lenv *par;
+  interp_t *interp;
+  // Nonzero while other threads can see this environment, see lenv_share.
+  // Only accessed through __atomic builtins.
+  int shared;
   int count;
   char** syms;
   lval** vals;
 };
 
+// Error codes, the message for each lives in lerr_table
 enum {
   LERR_DIV_ZERO,
   LERR_BAD_OP,
   LERR_BAD_NUM,
-  LERR_MOD_FLOAT
+  LERR_MOD_FLOAT,
+  LERR_BAD_TYPE,
+  LERR_NOT_NUM,
+  LERR_EMPTY_ARG,
+  LERR_NUM_ARGS,
+  LERR_UNBOUND_SYM,
+  LERR_SEXPR_START,
+  LERR_TOO_MANY_ARGS,
+  LERR_BAD_VARARGS,
+  LERR_DEF_NON_SYM,
+  LERR_DEF_COUNT,
+  LERR_LAMBDA_NON_SYM,
+  LERR_PARSE_UNEXPECTED,
+  LERR_PARSE_EOF,
+  LERR_MESSAGE,
+  LERR_IMAGE_WRITE,
+  LERR_FILE_WRITE,
+  LERR_FILE_READ,
+  LERR_EXIT,
+  LERR_BAD_PATH,
+  LERR_COUNT
 };
 
 // Builtin asserts
-#define LASSERT(args, cond, fmt, ...)         \
-  if (!(cond)) {                              \
-    lval* err = lval_err(fmt, ##__VA_ARGS__); \
-    lval_del(args);                           \
-    return err;                               \
+#define LASSERT(args, cond, code, ...)         \
+  if (!(cond)) {                               \
+    lval* err = lval_err(code, ##__VA_ARGS__); \
+    lval_del(args);                            \
+    return err;                                \
   }
 
-#define LASSERT_TYPE(func, args, index, expect)            \
-  LASSERT(args, args->cell[index]->type == expect,         \
-    "Function %s passeed incorrect type for argument %i. " \
-    "Got %s, expected %s.",                                \
-    func, index, ltype_name(args->cell[index]->type),      \
+#define LASSERT_TYPE(func, args, index, expect)       \
+  LASSERT(args, args->cell[index]->type == expect,    \
+    LERR_BAD_TYPE,                                    \
+    func, index, ltype_name(args->cell[index]->type), \
     ltype_name(expect))
 
 #define LASSERT_NUM(func, args, index)                          \
   if(args->cell[index]->type != LVAL_NUM_LONG) {                \
     if(args->cell[index]->type != LVAL_NUM_DOUBLE) {            \
       LASSERT(args, args->cell[index]->type == LVAL_NUM_DOUBLE, \
-        "Function %s passed incorrect type for argument %d. "   \
-        "Got %s, expected Number.",                             \
+        LERR_NOT_NUM,                                           \
         func, index, ltype_name(args->cell[index]->type)); }}    \
 
-#define LASSERT_EMPTY_ARGS(func, args, index)               \
-  LASSERT(args, args->cell[0]->count != 0,                  \
-    "Function %s passed empty expression for argument %d.", \
-    func, index);                                           \
+// A path is given as a quoted symbol, e.g. {xs_bin}
+#define LASSERT_PATH(func, args, index)                     \
+  LASSERT(args, args->cell[index]->count == 1               \
+    && args->cell[index]->cell[0]->type == LVAL_SYM,        \
+    LERR_BAD_PATH, func, index)
 
-#define LASSERT_NUM_ARGS(func, args, num)                \
-  LASSERT(args, args->count == num,                      \
-    "Function %s passed incorrect number of arguments. " \
-    "Got %d, expected %d.",                              \
-    func, args->count, num);                             \
+#define LASSERT_EMPTY_ARGS(func, args, index)  \
+  LASSERT(args, args->cell[0]->count != 0,     \
+    LERR_EMPTY_ARG, func, index);              \
+
+#define LASSERT_NUM_ARGS(func, args, num)      \
+  LASSERT(args, args->count == num,            \
+    LERR_NUM_ARGS, func, args->count, num);    \
 
 lval* eval(mpc_ast_t *t);
 lval* eval_op(lval x, char *op, lval y);
@@ -100,8 +175,12 @@ lval* lval_eval_sexpr(lenv *e, lval *v);
 lval* lval_eval(lenv *e, lval *v);
 lval* lval_num_long(long x);
 lval* lval_num_double(double x);
-lval* lval_err(char* fmt, ...);
+lval* lval_err(int code, ...);
+void lval_err_print(lval *v);
+void lval_err_write(lbuf *b, lval *v);
+int lval_err_string(lval *v, char *buf, int size);
 lval* lval_sym(char* s);
+lval* lval_sym_n(const char* s, size_t n);
 lval* lval_sexpr(void);
 lval* lval_read_num(mpc_ast_t *t);
 lval* lval_read(mpc_ast_t *t);
@@ -132,22 +211,41 @@ lval* lval_join(lval *x, lval *y);
 
 lval* lval_fun(lbuiltin func);
 lval* lval_copy(lval *v);
-void lval_expr_print(lval *v, char open, char close);
+void lval_write(lbuf *b, lval *v);
 void lval_del(lval *v);
 void lval_print(lval *v);
 void lval_println(lval *v);
+char* lval_to_string(lval *v);
 
 lenv* lenv_new(void);
 lval* lenv_get(lenv *e, lval *k);
 lenv* lenv_copy(lenv *e);
+lenv* lenv_capture(lenv *e);
+void lenv_share(lenv *e);
+void lenv_unshare(lenv *e);
 void lenv_put(lenv *e, lval *k, lval* v);
+void lenv_move(lenv *e, lval *k, lval* v);
 void lenv_del(lenv *e);
 void lenv_add_builtin(lenv *e, char* name, lbuiltin func);
 void lenv_add_builtins(lenv *e);
 
 lval* builtin_def(lenv* e, lval* a);
+lval* builtin_save_image(lenv *e, lval *a);
+lval* builtin_serialize(lenv *e, lval *a);
+lval* builtin_deserialize(lenv *e, lval *a);
+lval* builtin_par(lenv *e, lval *a);
+lval* builtin_pcall(lenv *e, lval *a);
+lval* builtin_future(lenv *e, lval *a);
+lval* builtin_spawn(lenv *e, lval *a);
+lval* builtin_touch(lenv *e, lval *a);
+lval* builtin_pmap(lenv *e, lval *a);
+lval* builtin_pfilter(lenv *e, lval *a);
+lval* builtin_preduce(lenv *e, lval *a);
 lval* lenv_print(lenv *e);
 void eval_single_expression(lenv *e, lval *v);
+void lispy_grammar(mpc_parser_t *Number, mpc_parser_t *Symbol,
+  mpc_parser_t *Sexpr, mpc_parser_t *Qexpr, mpc_parser_t *Expr,
+  mpc_parser_t *Lispy);
 // Function stuff
 lval* lval_lambda(lval* formals, lval* body);
 lval* builtin_lambda(lenv *e, lval *a);
@@ -159,4 +257,8 @@ char* ltype_name(int t);
 int numLeaves(mpc_ast_t *t);
 int numBranches(mpc_ast_t *t);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,286 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// Each worker owns a Chase-Lev deque. It pushes and takes tasks at the
+// bottom, while idle workers steal from the top of a victim's deque. Threads
+// outside the pool, such as the main thread, hand tasks over through a
+// locked injection queue instead. Any thread waiting on a counter runs tasks
+// meanwhile, so nested waits cannot starve the pool.
+//
+// The deque follows "Correct and Efficient Work-Stealing for Weak Memory
+// Models" (Lê et al. 2013).
+typedef struct {
+  long size;
+  _Atomic(ltask*) slots[];
+} lring;
+
+typedef struct {
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(lring*) ring;
+} ldeque;
+
+#define LPOOL_RING_SIZE 1024
+
+static pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+static int lpool_threads = 1;
+static int lpool_workers = 0;
+static ldeque *lpool_deques = NULL;
+
+// Index of the calling thread's deque, or -1 outside the pool
+static __thread int lpool_self = -1;
+
+// Tasks submitted from outside the pool
+static pthread_mutex_t lpool_inject_lock = PTHREAD_MUTEX_INITIALIZER;
+static ltask *lpool_inject_head = NULL;
+static ltask *lpool_inject_tail = NULL;
+static atomic_int lpool_injected = 0;
+
+// Threads with nothing to do sleep on lpool_wake, and are woken whenever a
+// task is submitted or finishes
+static pthread_mutex_t lpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lpool_wake = PTHREAD_COND_INITIALIZER;
+static atomic_int lpool_sleepers = 0;
+
+static lring* lring_new(long size) {
+  lring *r = malloc(sizeof(lring) + sizeof(ltask*) * size);
+  r->size = size;
+  return r;
+}
+
+// Doubles the ring of a deque. Thieves may still be reading the old ring,
+// so it is never freed.
+static lring* ldeque_grow(ldeque *d, lring *r, long top, long bottom) {
+  lring *g = lring_new(r->size * 2);
+  for (long i = top; i < bottom; i++) {
+    ltask *t = atomic_load_explicit(&r->slots[i % r->size], memory_order_relaxed);
+    atomic_store_explicit(&g->slots[i % g->size], t, memory_order_relaxed);
+  }
+  atomic_store_explicit(&d->ring, g, memory_order_release);
+  return g;
+}
+
+// Only called by the owner
+static void ldeque_push(ldeque *d, ltask *t) {
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&d->top, memory_order_acquire);
+  lring *r = atomic_load_explicit(&d->ring, memory_order_relaxed);
+  if (b - top > r->size - 1) { r = ldeque_grow(d, r, top, b); }
+  atomic_store_explicit(&r->slots[b % r->size], t, memory_order_relaxed);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+}
+
+// Only called by the owner
+static ltask* ldeque_take(ldeque *d) {
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  lring *r = atomic_load_explicit(&d->ring, memory_order_relaxed);
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+  ltask *t = NULL;
+  if (top <= b) {
+    t = atomic_load_explicit(&r->slots[b % r->size], memory_order_relaxed);
+    if (top == b) {
+      // Last task, race any thieves for it
+      if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+          memory_order_seq_cst, memory_order_relaxed)) {
+        t = NULL;
+      }
+      atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+  } else {
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  return t;
+}
+
+// Called by any thread
+static ltask* ldeque_steal(ldeque *d) {
+  long top = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  if (top >= b) { return NULL; }
+
+  lring *r = atomic_load_explicit(&d->ring, memory_order_acquire);
+  ltask *t = atomic_load_explicit(&r->slots[top % r->size], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+      memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+  return t;
+}
+
+static int ldeque_empty(ldeque *d) {
+  long top = atomic_load_explicit(&d->top, memory_order_acquire);
+  long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  return top >= b;
+}
+
+static ltask* lpool_take_injected(void) {
+  if (!atomic_load_explicit(&lpool_injected, memory_order_acquire)) {
+    return NULL;
+  }
+  pthread_mutex_lock(&lpool_inject_lock);
+  ltask *t = lpool_inject_head;
+  if (t) {
+    lpool_inject_head = t->next;
+    if (!lpool_inject_head) { lpool_inject_tail = NULL; }
+    atomic_fetch_sub(&lpool_injected, 1);
+  }
+  pthread_mutex_unlock(&lpool_inject_lock);
+  return t;
+}
+
+// Finds a task for the calling thread: its own newest, then the injection
+// queue, then the oldest task of another worker
+static ltask* lpool_find(void) {
+  ltask *t = NULL;
+  if (lpool_self >= 0) { t = ldeque_take(&lpool_deques[lpool_self]); }
+  if (!t) { t = lpool_take_injected(); }
+
+  int start = lpool_self >= 0 ? lpool_self + 1 : 0;
+  for (int i = 0; !t && i < lpool_workers; i++) {
+    int victim = (start + i) % lpool_workers;
+    if (victim != lpool_self) { t = ldeque_steal(&lpool_deques[victim]); }
+  }
+  return t;
+}
+
+static int lpool_has_work(void) {
+  if (atomic_load(&lpool_injected)) { return 1; }
+  for (int i = 0; i < lpool_workers; i++) {
+    if (!ldeque_empty(&lpool_deques[i])) { return 1; }
+  }
+  return 0;
+}
+
+// Wakes every sleeping thread. The fence pairs with the one in lpool_sleep
+// so either the sleeper sees the new state or we see the sleeper.
+static void lpool_notify(void) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&lpool_sleepers) > 0) {
+    pthread_mutex_lock(&lpool_lock);
+    pthread_cond_broadcast(&lpool_wake);
+    pthread_mutex_unlock(&lpool_lock);
+  }
+}
+
+// Sleeps until there is work or, if counter is given, it reaches zero
+static void lpool_sleep(atomic_int *counter) {
+  pthread_mutex_lock(&lpool_lock);
+  atomic_fetch_add(&lpool_sleepers, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!(counter && atomic_load(counter) == 0) && !lpool_has_work()) {
+    pthread_cond_wait(&lpool_wake, &lpool_lock);
+  }
+  atomic_fetch_sub(&lpool_sleepers, 1);
+  pthread_mutex_unlock(&lpool_lock);
+}
+
+static void lpool_exec(ltask *t) {
+  // The task may be freed by cleanup or by whoever waits on the counter
+  void (*cleanup)(void*) = t->cleanup;
+  void *arg = t->arg;
+  atomic_int *counter = t->counter;
+
+  t->fn(arg);
+  atomic_fetch_sub(counter, 1);
+  lpool_notify();
+  if (cleanup) { cleanup(arg); }
+}
+
+static void* lpool_worker(void *arg) {
+  lpool_self = (int)(long)arg;
+  for (;;) {
+    ltask *t = lpool_find();
+    if (t) {
+      lpool_exec(t);
+    } else {
+      lpool_sleep(NULL);
+    }
+  }
+  return NULL;
+}
+
+// One thread per core unless LISPY_THREADS says otherwise. The thread that
+// starts the pool counts as one of them.
+static void lpool_start(void) {
+  const char *env = getenv("LISPY_THREADS");
+  long n = env ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) { n = 1; }
+
+  lpool_deques = calloc(n, sizeof(ldeque));
+  for (long i = 0; i < n; i++) {
+    atomic_init(&lpool_deques[i].ring, lring_new(LPOOL_RING_SIZE));
+  }
+
+  // Workers are detached and live until the process exits. They read
+  // lpool_workers, so it is set before any of them start.
+  lpool_workers = n - 1;
+  for (long i = 0; i < lpool_workers; i++) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, lpool_worker, (void*)i) != 0) { break; }
+    pthread_detach(t);
+    lpool_threads++;
+  }
+}
+
+int lpool_size(void) {
+  pthread_once(&lpool_once, lpool_start);
+  return lpool_threads;
+}
+
+void lpool_submit(ltask *t) {
+  pthread_once(&lpool_once, lpool_start);
+
+  // Nothing could steal it, so run it now
+  if (lpool_threads == 1) {
+    lpool_exec(t);
+    return;
+  }
+
+  if (lpool_self >= 0) {
+    ldeque_push(&lpool_deques[lpool_self], t);
+  } else {
+    t->next = NULL;
+    pthread_mutex_lock(&lpool_inject_lock);
+    if (lpool_inject_tail) { lpool_inject_tail->next = t; }
+    else { lpool_inject_head = t; }
+    lpool_inject_tail = t;
+    atomic_fetch_add(&lpool_injected, 1);
+    pthread_mutex_unlock(&lpool_inject_lock);
+  }
+  lpool_notify();
+}
+
+void lpool_wait(atomic_int *counter) {
+  while (atomic_load(counter) > 0) {
+    ltask *t = lpool_find();
+    if (t) {
+      lpool_exec(t);
+    } else {
+      lpool_sleep(counter);
+    }
+  }
+}
+
+void lpool_run(ltask *tasks, int n) {
+  if (n <= 0) { return; }
+
+  atomic_int remaining = n;
+  for (int i = 0; i < n; i++) {
+    tasks[i].counter = &remaining;
+    tasks[i].cleanup = NULL;
+  }
+
+  // Queue all but the first task, which this thread starts on straight away
+  for (int i = n - 1; i > 0; i--) {
+    lpool_submit(&tasks[i]);
+  }
+  lpool_exec(&tasks[0]);
+  lpool_wait(&remaining);
+}
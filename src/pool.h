@@ -0,0 +1,30 @@
+#ifndef pool_h
+#define pool_h
+
+#include <stdatomic.h>
+
+// A unit of work for the thread pool. When fn returns, counter is
+// decremented and then cleanup, if any, is called with arg. The task is not
+// touched after that.
+typedef struct ltask {
+  void (*fn)(void *arg);
+  void (*cleanup)(void *arg);
+  void *arg;
+  atomic_int *counter;
+  struct ltask *next;
+} ltask;
+
+// Number of threads evaluating in parallel, including the caller's
+int lpool_size(void);
+
+// Starts a task without waiting for it
+void lpool_submit(ltask *t);
+
+// Runs other tasks until *counter reaches zero
+void lpool_wait(atomic_int *counter);
+
+// Runs every task and returns once all of them are done. The calling thread
+// runs tasks too, so it is safe to call from inside a task.
+void lpool_run(ltask *tasks, int n);
+
+#endif
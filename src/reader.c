@@ -0,0 +1,208 @@
+#include <limits.h>
+#include <unistd.h>
+
+#include "reader.h"
+
+// Converts a number token that is not necessarily null terminated
+lval* lval_read_num_str(const char *s, size_t len) {
+  if (memchr(s, '.', len)) {
+    char buf[64];
+    char *b = len < sizeof(buf) ? buf : malloc(len + 1);
+    memcpy(b, s, len);
+    b[len] = '\0';
+
+    errno = 0;
+    double x = strtod(b, NULL);
+    int range = errno == ERANGE;
+    if (b != buf) { free(b); }
+    return !range ? lval_num_double(x) : lval_err(LERR_BAD_NUM);
+  }
+
+  // Accumulate negatively so LONG_MIN can be represented
+  size_t i = s[0] == '-';
+  long x = 0;
+  for (; i < len; i++) {
+    int d = s[i] - '0';
+    if (x < (LONG_MIN + d) / 10) { return lval_err(LERR_BAD_NUM); }
+    x = x * 10 - d;
+  }
+  if (s[0] != '-') {
+    if (x == LONG_MIN) { return lval_err(LERR_BAD_NUM); }
+    x = -x;
+  }
+  return lval_num_long(x);
+}
+
+void lreader_init(lreader *r, const char *filename, const char *s, size_t len) {
+  r->filename = filename;
+  llexer_init(&r->lex, s, len);
+  r->file = NULL;
+  r->buf = NULL;
+  r->buf_len = 0;
+  r->buf_slots = 0;
+  r->eof = 1;
+  r->row = 1;
+  r->col = 1;
+  r->depth = 0;
+  r->slots = 0;
+  r->stack = NULL;
+}
+
+// Reads expressions from a file or pipe as they arrive, holding only the
+// unread part of the input and the expression currently being read. The
+// file's descriptor is read directly, so nothing may have been read from it
+// through stdio before.
+void lreader_init_file(lreader *r, const char *filename, FILE *file) {
+  lreader_init(r, filename, NULL, 0);
+  r->file = file;
+  r->eof = 0;
+}
+
+// Most read from a streamed file at once
+#define LREAD_BLOCK 65536
+
+// Drops the input that has been lexed and reads whatever has arrived, up to
+// a block, waiting only while nothing has. Only input up to the last
+// whitespace or bracket is handed to the lexer, so a token is never split
+// across reads. Returns 0 once the input is exhausted.
+static int lreader_refill(lreader *r) {
+  if (!r->file || (r->eof && r->lex.pos == r->buf_len)) { return 0; }
+
+  // Everything before the lexer's position has been read into lvals
+  size_t done = r->lex.pos;
+  for (size_t i = 0; i < done; i++) {
+    if (r->buf[i] == '\n') { r->row++; r->col = 1; } else { r->col++; }
+  }
+  if (done > 0) {
+    memmove(r->buf, r->buf + done, r->buf_len - done);
+    r->buf_len -= done;
+  }
+
+  if (!r->eof) {
+    if (r->buf_slots - r->buf_len < LREAD_BLOCK) {
+      r->buf_slots = r->buf_len + LREAD_BLOCK;
+      r->buf = realloc(r->buf, r->buf_slots);
+    }
+    ssize_t got;
+    do {
+      got = read(fileno(r->file), r->buf + r->buf_len, LREAD_BLOCK);
+    } while (got < 0 && errno == EINTR);
+    if (got > 0) { r->buf_len += got; } else { r->eof = 1; }
+  }
+
+  size_t avail = r->buf_len;
+  if (!r->eof) {
+    while (avail > 0 && !strchr(" \f\n\r\t\v(){}", r->buf[avail - 1])) { avail--; }
+  }
+  llexer_init(&r->lex, r->buf, avail);
+  return 1;
+}
+
+// Delete any lists that were never closed
+static void lreader_reset(lreader *r) {
+  for (int i = 0; i < r->depth; i++) {
+    lval_del(r->stack[i]);
+  }
+  r->depth = 0;
+}
+
+void lreader_free(lreader *r) {
+  lreader_reset(r);
+  free(r->stack);
+  r->stack = NULL;
+  r->slots = 0;
+  free(r->buf);
+  r->buf = NULL;
+}
+
+// Builds a parse error at a position in the input. The row and column are
+// only worked out here so reading never has to track them.
+static lval* lreader_err(lreader *r, int code, size_t pos, char c) {
+  int row = r->row, col = r->col;
+  for (size_t i = 0; i < pos; i++) {
+    if (r->lex.s[i] == '\n') { row++; col = 1; } else { col++; }
+  }
+
+  // Stop reading, the rest of the input can't be trusted
+  lreader_reset(r);
+  llexer_init(&r->lex, r->lex.s, 0);
+  r->file = NULL;
+  return lval_err(code, r->filename, row, col, c);
+}
+
+// Returns the next token, reading more of a streamed file as needed
+static ltoken* lreader_token(lreader *r) {
+  ltoken *t;
+  while (!(t = llex_next(&r->lex))) {
+    if (!lreader_refill(r)) { return NULL; }
+  }
+  return t;
+}
+
+// Reads the next top level expression.
+// Returns NULL at the end of the input, or an error on invalid input.
+lval* lreader_next(lreader *r) {
+  ltoken *t;
+
+  while ((t = lreader_token(r))) {
+    const char *s = r->lex.s + t->pos;
+    lval *x = NULL;
+
+    switch (t->type) {
+      case LTOK_OPEN_SEXPR:
+      case LTOK_OPEN_QEXPR:
+        // Open a new list and keep reading into it
+        if (r->depth == r->slots) {
+          r->slots = r->slots ? r->slots * 2 : 16;
+          r->stack = realloc(r->stack, sizeof(lval*) * r->slots);
+        }
+        r->stack[r->depth++] =
+          t->type == LTOK_OPEN_SEXPR ? lval_sexpr() : lval_qexpr();
+        continue;
+      case LTOK_CLOSE_SEXPR:
+      case LTOK_CLOSE_QEXPR:
+        if (r->depth == 0 || r->stack[r->depth - 1]->type !=
+          (t->type == LTOK_CLOSE_SEXPR ? LVAL_SEXPR : LVAL_QEXPR)) {
+          return lreader_err(r, LERR_PARSE_UNEXPECTED, t->pos, *s);
+        }
+        x = r->stack[--r->depth];
+        break;
+      case LTOK_NUMBER:
+        x = lval_read_num_str(s, t->len);
+        break;
+      case LTOK_SYMBOL:
+        x = lval_sym_n(s, t->len);
+        break;
+      default:
+        return lreader_err(r, LERR_PARSE_UNEXPECTED, t->pos, *s);
+    }
+
+    if (r->depth == 0) { return x; }
+    lval_add(r->stack[r->depth - 1], x);
+  }
+
+  if (r->depth == 0) { return NULL; }
+  lval *open = r->stack[r->depth - 1];
+  return lreader_err(r, LERR_PARSE_EOF, r->lex.len,
+    open->type == LVAL_SEXPR ? ')' : '}');
+}
+
+// Reads a whole buffer into a single S-Expression, like the lispy rule
+lval* lval_read_str(const char *filename, const char *s, size_t len) {
+  lreader r;
+  lreader_init(&r, filename, s, len);
+
+  lval *x = lval_sexpr();
+  lval *y;
+  while ((y = lreader_next(&r))) {
+    if (y->type == LVAL_ERR) {
+      lval_del(x);
+      x = y;
+      break;
+    }
+    x = lval_add(x, y);
+  }
+
+  lreader_free(&r);
+  return x;
+}
@@ -0,0 +1,38 @@
+#ifndef reader_h
+#define reader_h
+
+#include "parsing.h"
+#include "lexer.h"
+
+// Reads lvals directly from a buffer in a single pass, without building an
+// intermediate mpc_ast_t tree. Accepts the same language as the lispy grammar
+// in main. Tokens come from the table driven lexer.
+typedef struct {
+  const char *filename;
+  llexer lex;
+
+  // When streaming from a file the input lives in buf, which only holds
+  // what has not been lexed yet. row and col are the position of buf[0].
+  FILE *file;
+  char *buf;
+  size_t buf_len;
+  size_t buf_slots;
+  int eof;
+  int row;
+  int col;
+
+  // Stack of lists still waiting for their closing bracket
+  int depth;
+  int slots;
+  lval **stack;
+} lreader;
+
+void lreader_init(lreader *r, const char *filename, const char *s, size_t len);
+void lreader_init_file(lreader *r, const char *filename, FILE *file);
+void lreader_free(lreader *r);
+lval* lreader_next(lreader *r);
+
+lval* lval_read_str(const char *filename, const char *s, size_t len);
+lval* lval_read_num_str(const char *s, size_t len);
+
+#endif
@@ -0,0 +1,601 @@
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "serial.h"
+#include "future.h"
+
+// Encoding:
+//
+//   "LSER" varint:nbuiltins varint:fingerprint
+//   varint:nsyms { varint:length bytes }*nsyms payload
+//
+// Builtins are written as their index into lbuiltin_table, so the header
+// carries the size of the table and lbuiltin_fingerprint, the hash of its
+// names. An encoding from a build with a different table is refused rather
+// than bound to the wrong builtins.
+//
+// Every symbol, and every name bound in a function's environment, is stored
+// once in the symbol table and referred to by its index. The payload is
+// either a single value or, for an environment, varint:count
+// { varint:symbol value }*count. A value is a type byte followed by
+//
+//   LVAL_NUM_LONG    zigzag varint
+//   LVAL_NUM_DOUBLE  the eight bytes of the IEEE double, little endian
+//   LVAL_SYM         varint:symbol
+//   LVAL_ERR         varint:length bytes, the formatted message
+//   LVAL_SEXPR/QEXPR varint:count value*count
+//   LVAL_FUN         u8:1 varint:index into lbuiltin_table, or
+//                    u8:0 environment value:formals value:body
+//
+// A future is waited for and written as its value. A channel only means
+// something inside the running process, so it is written as an error.
+#define SERIAL_MAGIC "LSER"
+
+// Interns symbols while writing. A slot's key is where the name's bytes
+// start in table plus one, or 0 when the slot is empty. The table keeps
+// its own copy of every name, since the values holding them can be freed
+// before writing is done.
+typedef struct {
+  lbuf table;
+  lbuf payload;
+  int count;
+  int slots;
+  size_t *keys;
+  size_t *lens;
+  int *index;
+} lser_out;
+
+static void lser_varint(lbuf *b, uint64_t x) {
+  while (x >= 0x80) {
+    lbuf_putc(b, (char)(x | 0x80));
+    x >>= 7;
+  }
+  lbuf_putc(b, (char)x);
+}
+
+static void lser_bytes(lbuf *b, const char *s, size_t n) {
+  lser_varint(b, n);
+  lbuf_put(b, s, n);
+}
+
+static unsigned long lser_hash(const char *s, size_t n) {
+  unsigned long h = 5381;
+  for (size_t i = 0; i < n; i++) { h = h * 33 + (unsigned char)s[i]; }
+  return h;
+}
+
+// Returns the index of a symbol, adding it to the table the first time
+static int lser_intern(lser_out *o, const char *s) {
+  if (o->count * 2 >= o->slots) {
+    int slots = o->slots ? o->slots * 2 : 64;
+    size_t *keys = calloc(slots, sizeof(size_t));
+    size_t *lens = malloc(sizeof(size_t) * slots);
+    int *index = malloc(sizeof(int) * slots);
+    for (int i = 0; i < o->slots; i++) {
+      if (!o->keys[i]) { continue; }
+      const char *k = o->table.data + o->keys[i] - 1;
+      unsigned long j = lser_hash(k, o->lens[i]) & (slots - 1);
+      while (keys[j]) { j = (j + 1) & (slots - 1); }
+      keys[j] = o->keys[i];
+      lens[j] = o->lens[i];
+      index[j] = o->index[i];
+    }
+    free(o->keys);
+    free(o->lens);
+    free(o->index);
+    o->keys = keys;
+    o->lens = lens;
+    o->index = index;
+    o->slots = slots;
+  }
+
+  size_t n = strlen(s);
+  unsigned long j = lser_hash(s, n) & (o->slots - 1);
+  while (o->keys[j]) {
+    if (o->lens[j] == n
+        && memcmp(o->table.data + o->keys[j] - 1, s, n) == 0) {
+      return o->index[j];
+    }
+    j = (j + 1) & (o->slots - 1);
+  }
+
+  lser_bytes(&o->table, s, n);
+  o->keys[j] = o->table.len - n + 1;
+  o->lens[j] = n;
+  o->index[j] = o->count;
+  return o->count++;
+}
+
+// Writes a value that holds no others, or the header of one that does.
+// Returns 1 if its parts have to be written after it.
+static int lser_put_atom(lser_out *o, lval *v) {
+  // Natives registered by an embedder aren't in lbuiltin_table, so there
+  // is nothing to refer to them by
+  if (v->type == LVAL_FUN && v->builtin && lbuiltin_index(v->builtin) < 0) {
+    lval *x = lval_err(LERR_MESSAGE, "Native builtins cannot be serialized");
+    lser_put_atom(o, x);
+    lval_del(x);
+    return 0;
+  }
+  if (v->type == LVAL_CHAN) {
+    lval *x = lval_err(LERR_MESSAGE, "Channels cannot be serialized");
+    lser_put_atom(o, x);
+    lval_del(x);
+    return 0;
+  }
+
+  lbuf *b = &o->payload;
+  lbuf_putc(b, (char)v->type);
+
+  switch (v->type) {
+    case LVAL_NUM_LONG: {
+      uint64_t x = (uint64_t)v->num.num_long;
+      lser_varint(b, (x << 1) ^ (v->num.num_long < 0 ? ~(uint64_t)0 : 0));
+      return 0;
+    }
+    case LVAL_NUM_DOUBLE: {
+      uint64_t bits;
+      memcpy(&bits, &v->num.num_double, sizeof(bits));
+      for (int i = 0; i < 8; i++) { lbuf_putc(b, (char)(bits >> (8 * i))); }
+      return 0;
+    }
+    case LVAL_SYM:
+      lser_varint(b, lser_intern(o, v->sym));
+      return 0;
+    case LVAL_ERR: {
+      char msg[512];
+      int n = lval_err_string(v, msg, sizeof(msg));
+      lser_bytes(b, msg, n < (int)sizeof(msg) ? n : (int)sizeof(msg) - 1);
+      return 0;
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lser_varint(b, v->count);
+      return v->count > 0;
+    case LVAL_FUN:
+      if (v->builtin) {
+        lbuf_putc(b, 1);
+        lser_varint(b, lbuiltin_index(v->builtin));
+        return 0;
+      }
+      lbuf_putc(b, 0);
+      lser_varint(b, v->env->count);
+      return 1;
+  }
+  return 0;
+}
+
+// A list or lambda whose parts are being written. A lambda's parts are the
+// bindings of its environment, then its formals and body. owned is the
+// value of a future, deleted once it has been written.
+typedef struct {
+  lval *v;
+  int next;
+  lval *owned;
+} lser_put_frame;
+
+// Writes a value, keeping the lists and lambdas it is nested in on a stack
+// rather than recursing, so its depth isn't limited by the C stack
+static void lser_put_lval(lser_out *o, lval *v) {
+  lser_put_frame *stack = NULL;
+  int n = 0, slots = 0;
+
+  while (v) {
+    // A future is written as its value
+    lval *owned = NULL;
+    while (v->type == LVAL_FUTURE) {
+      lval *x = lfuture_touch(v->future);
+      if (owned) { lval_del(owned); }
+      owned = v = x;
+    }
+
+    if (lser_put_atom(o, v)) {
+      if (n == slots) {
+        slots = slots ? slots * 2 : 32;
+        stack = realloc(stack, sizeof(lser_put_frame) * slots);
+      }
+      stack[n++] = (lser_put_frame){ v, 0, owned };
+    } else if (owned) {
+      lval_del(owned);
+    }
+
+    // Close everything finished and find the next part to write
+    v = NULL;
+    while (n && !v) {
+      lser_put_frame *top = &stack[n - 1];
+      lval *l = top->v;
+      if (l->type == LVAL_FUN) {
+        int i = top->next++;
+        if (i < l->env->count) {
+          lser_varint(&o->payload, lser_intern(o, l->env->syms[i]));
+          v = l->env->vals[i];
+        } else if (i - l->env->count < 2) {
+          v = i == l->env->count ? l->formals : l->body;
+        }
+      } else if (top->next < l->count) {
+        v = l->cell[top->next++];
+      }
+      if (!v) {
+        if (top->owned) { lval_del(top->owned); }
+        n--;
+      }
+    }
+  }
+
+  free(stack);
+}
+
+static void lser_put_env(lser_out *o, lenv *e) {
+  lser_varint(&o->payload, e->count);
+  for (int i = 0; i < e->count; i++) {
+    lser_varint(&o->payload, lser_intern(o, e->syms[i]));
+    lser_put_lval(o, e->vals[i]);
+  }
+}
+
+static void lser_out_init(lser_out *o) {
+  lbuf_init(&o->table);
+  lbuf_init(&o->payload);
+  o->count = 0;
+  o->slots = 0;
+  o->keys = NULL;
+  o->lens = NULL;
+  o->index = NULL;
+}
+
+// Writes the header and symbol table followed by the payload
+static void lser_out_finish(lser_out *o, lbuf *out) {
+  lbuf_put(out, SERIAL_MAGIC, 4);
+  lser_varint(out, lbuiltin_count);
+  lser_varint(out, lbuiltin_fingerprint());
+  lser_varint(out, o->count);
+  lbuf_put(out, o->table.data, o->table.len);
+  lbuf_put(out, o->payload.data, o->payload.len);
+
+  lbuf_free(&o->table);
+  lbuf_free(&o->payload);
+  free(o->keys);
+  free(o->lens);
+  free(o->index);
+}
+
+// Appends the encoding of v to out
+void lval_serialize(lval *v, lbuf *out) {
+  lser_out o;
+  lser_out_init(&o);
+  lser_put_lval(&o, v);
+  lser_out_finish(&o, out);
+}
+
+// Appends the encoding of every binding in e to out
+void lenv_serialize(lenv *e, lbuf *out) {
+  lser_out o;
+  lser_out_init(&o);
+  lser_put_env(&o, e);
+  lser_out_finish(&o, out);
+}
+
+// Cursor over an encoding. Any read past the end, or anything malformed,
+// sets err.
+typedef struct {
+  const unsigned char *p;
+  const unsigned char *end;
+  int err;
+
+  // Symbol table, pointing into the input
+  uint64_t nsyms;
+  const char **syms;
+  size_t *lens;
+} lser_in;
+
+static const unsigned char* lser_get(lser_in *in, size_t n) {
+  if (in->err || (size_t)(in->end - in->p) < n) {
+    in->err = 1;
+    return NULL;
+  }
+  const unsigned char *p = in->p;
+  in->p += n;
+  return p;
+}
+
+static uint64_t lser_get_varint(lser_in *in) {
+  uint64_t x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    const unsigned char *c = lser_get(in, 1);
+    if (!c) { return 0; }
+    x |= (uint64_t)(*c & 0x7f) << shift;
+    if (!(*c & 0x80)) { return x; }
+  }
+  in->err = 1;
+  return 0;
+}
+
+// Returns a symbol table index, or -1
+static long lser_get_sym(lser_in *in) {
+  uint64_t i = lser_get_varint(in);
+  if (in->err || i >= in->nsyms) {
+    in->err = 1;
+    return -1;
+  }
+  return (long)i;
+}
+
+static int lser_in_init(lser_in *in, const char *data, size_t len) {
+  in->p = (const unsigned char*)data;
+  in->end = in->p + len;
+  in->err = 0;
+  in->nsyms = 0;
+  in->syms = NULL;
+  in->lens = NULL;
+
+  const unsigned char *magic = lser_get(in, 4);
+  if (!magic || memcmp(magic, SERIAL_MAGIC, 4) != 0) { return 1; }
+
+  // Builtin indices only mean the same thing with the same table
+  uint64_t nbuiltins = lser_get_varint(in);
+  uint64_t fingerprint = lser_get_varint(in);
+  if (in->err || nbuiltins != (uint64_t)lbuiltin_count
+    || fingerprint != lbuiltin_fingerprint()) {
+    return 1;
+  }
+
+  // Every symbol takes at least a byte, so a bad count can't over allocate
+  uint64_t n = lser_get_varint(in);
+  if (in->err || n > (uint64_t)(in->end - in->p)) { return 1; }
+
+  in->syms = malloc(sizeof(char*) * (n ? n : 1));
+  in->lens = malloc(sizeof(size_t) * (n ? n : 1));
+  for (uint64_t i = 0; i < n && !in->err; i++) {
+    in->lens[i] = lser_get_varint(in);
+    in->syms[i] = (const char*)lser_get(in, in->lens[i]);
+  }
+  in->nsyms = n;
+  return in->err;
+}
+
+static void lser_in_free(lser_in *in) {
+  free(in->syms);
+  free(in->lens);
+}
+
+// A list or lambda being rebuilt. A list's cells are filled in place and
+// left counts those still to come. A lambda collects left bindings into env,
+// sym being the key of the one being read, then its formals and body.
+typedef struct {
+  lval *x;
+  uint64_t left;
+  lenv *env;
+  long sym;
+  lval *formals;
+} lser_get_frame;
+
+// Reads a value that holds no others. A list or lambda is only opened,
+// returning NULL with *f set up to collect its parts. Returns NULL with
+// in->err set if the input is malformed.
+static lval* lser_get_atom(lser_in *in, lser_get_frame *f) {
+  const unsigned char *type = lser_get(in, 1);
+  if (!type) { return NULL; }
+
+  switch (*type) {
+    case LVAL_NUM_LONG: {
+      uint64_t x = lser_get_varint(in);
+      return in->err ? NULL : lval_num_long((long)((x >> 1) ^ -(x & 1)));
+    }
+    case LVAL_NUM_DOUBLE: {
+      const unsigned char *c = lser_get(in, 8);
+      if (!c) { return NULL; }
+      uint64_t bits = 0;
+      for (int i = 0; i < 8; i++) { bits |= (uint64_t)c[i] << (8 * i); }
+      double x;
+      memcpy(&x, &bits, sizeof(x));
+      return lval_num_double(x);
+    }
+    case LVAL_SYM: {
+      long s = lser_get_sym(in);
+      return s >= 0 ? lval_sym_n(in->syms[s], in->lens[s]) : NULL;
+    }
+    case LVAL_ERR: {
+      uint64_t n = lser_get_varint(in);
+      const char *s = (const char*)lser_get(in, n);
+      if (!s) { return NULL; }
+      lval *msg = lval_sym_n(s, n);
+      lval *x = lval_err(LERR_MESSAGE, msg->sym);
+      lval_del(msg);
+      return x;
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: {
+      uint64_t count = lser_get_varint(in);
+      if (in->err || count > (uint64_t)(in->end - in->p)) {
+        in->err = 1;
+        return NULL;
+      }
+
+      // Size the cells up front rather than growing them per element
+      lval *x = *type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+      x->cell = malloc(sizeof(lval*) * (count ? count : 1));
+      if (count == 0) { return x; }
+      *f = (lser_get_frame){ x, count, NULL, -1, NULL };
+      return NULL;
+    }
+    case LVAL_FUN: {
+      const unsigned char *builtin = lser_get(in, 1);
+      if (!builtin) { return NULL; }
+
+      if (*builtin) {
+        uint64_t i = lser_get_varint(in);
+        if (in->err || i >= (uint64_t)lbuiltin_count) {
+          in->err = 1;
+          return NULL;
+        }
+        return lval_fun(lbuiltin_table[i].func);
+      }
+
+      uint64_t count = lser_get_varint(in);
+      if (in->err) { return NULL; }
+      *f = (lser_get_frame){ NULL, count, lenv_new(), -1, NULL };
+      return NULL;
+    }
+    default:
+      in->err = 1;
+      return NULL;
+  }
+}
+
+// Whether a lambda can be made of formals and body: a Q-Expression of
+// symbols, where '&' may only come just before the last one, and a
+// Q-Expression body. Calls assume both.
+static int lser_lambda_ok(lval *formals, lval *body) {
+  if (formals->type != LVAL_QEXPR || body->type != LVAL_QEXPR) { return 0; }
+  for (int i = 0; i < formals->count; i++) {
+    lval *s = formals->cell[i];
+    if (s->type != LVAL_SYM) { return 0; }
+    if (strcmp(s->sym, "&") == 0 && i != formals->count - 2) { return 0; }
+  }
+  return 1;
+}
+
+// Rebuilds a value, returns NULL if the input is malformed. Lists and
+// lambdas still waiting for parts are kept on a stack rather than
+// recursing, so the depth of the input isn't limited by the C stack.
+static lval* lser_get_lval(lser_in *in) {
+  lser_get_frame *stack = NULL;
+  int n = 0, slots = 0;
+
+  for (;;) {
+    if (n == slots) {
+      slots = slots ? slots * 2 : 32;
+      stack = realloc(stack, sizeof(lser_get_frame) * slots);
+    }
+    lval *v = lser_get_atom(in, &stack[n]);
+    if (in->err) { break; }
+    if (!v) { n++; }
+
+    // Hand finished values to the frame waiting for them, and read the key
+    // of a lambda's next binding
+    while (n) {
+      lser_get_frame *top = &stack[n - 1];
+      if (v) {
+        if (top->x) {
+          top->x->cell[top->x->count++] = v;
+          top->left--;
+        } else if (top->sym >= 0) {
+          lval *k = lval_sym_n(in->syms[top->sym], in->lens[top->sym]);
+          lenv_move(top->env, k, v);
+          lval_del(k);
+          top->sym = -1;
+          top->left--;
+        } else if (!top->formals) {
+          top->formals = v;
+        } else if (!lser_lambda_ok(top->formals, v)) {
+          lval_del(v);
+          in->err = 1;
+          break;
+        } else {
+          lval *x = lval_lambda(top->formals, v);
+          lenv_del(x->env);
+          x->env = top->env;
+          v = x;
+          n--;
+          continue;
+        }
+        v = NULL;
+      }
+
+      if (top->x && top->left == 0) {
+        v = top->x;
+        n--;
+        continue;
+      }
+      if (!top->x && top->left > 0 && top->sym < 0) {
+        top->sym = lser_get_sym(in);
+      }
+      break;
+    }
+
+    if (in->err) { break; }
+    if (!n) {
+      free(stack);
+      return v;
+    }
+  }
+
+  // Malformed, drop whatever was rebuilt
+  for (int i = 0; i < n; i++) {
+    if (stack[i].x) {
+      lval_del(stack[i].x);
+    } else {
+      lenv_del(stack[i].env);
+      if (stack[i].formals) { lval_del(stack[i].formals); }
+    }
+  }
+  free(stack);
+  return NULL;
+}
+
+static int lser_get_env(lser_in *in, lenv *e) {
+  uint64_t count = lser_get_varint(in);
+  for (uint64_t i = 0; i < count && !in->err; i++) {
+    long s = lser_get_sym(in);
+    lval *v = s >= 0 ? lser_get_lval(in) : NULL;
+    if (!v) { return 1; }
+
+    lval *k = lval_sym_n(in->syms[s], in->lens[s]);
+    lenv_move(e, k, v);
+    lval_del(k);
+  }
+  return in->err;
+}
+
+// Decodes a value, returns NULL if the input is malformed
+lval* lval_deserialize(const char *data, size_t len) {
+  lser_in in;
+  lval *x = lser_in_init(&in, data, len) == 0 ? lser_get_lval(&in) : NULL;
+  lser_in_free(&in);
+  return x;
+}
+
+// Adds every binding in an encoded environment to e. Returns 0 on success.
+int lenv_deserialize(lenv *e, const char *data, size_t len) {
+  lser_in in;
+  int err = lser_in_init(&in, data, len) != 0 || lser_get_env(&in, e) != 0;
+  lser_in_free(&in);
+  return err;
+}
+
+// Writes the encoding of v to a file. Returns 0 on success.
+int lval_save(lval *v, const char *path) {
+  lbuf b;
+  lbuf_init(&b);
+  lval_serialize(v, &b);
+
+  FILE *f = fopen(path, "wb");
+  int ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+  if (f && fclose(f) != 0) { ok = 0; }
+
+  lbuf_free(&b);
+  return ok ? 0 : 1;
+}
+
+// Maps a file written by lval_save and decodes it, returns NULL on failure
+lval* lval_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { return NULL; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { return NULL; }
+
+  lval *x = lval_deserialize(map, st.st_size);
+  munmap(map, st.st_size);
+  return x;
+}
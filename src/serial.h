@@ -0,0 +1,19 @@
+#ifndef serial_h
+#define serial_h
+
+#include "parsing.h"
+#include "buffer.h"
+
+// Binary encoding of lvals for exchanging values between processes
+void lval_serialize(lval *v, lbuf *out);
+lval* lval_deserialize(const char *data, size_t len);
+
+// The same encoding for every binding of an environment
+void lenv_serialize(lenv *e, lbuf *out);
+int lenv_deserialize(lenv *e, const char *data, size_t len);
+
+// Files holding a single encoded value
+int lval_save(lval *v, const char *path);
+lval* lval_load(const char *path);
+
+#endif
@@ -0,0 +1,349 @@
+// accept4
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "interp.h"
+#include "serial.h"
+
+// The acceptor hands each new connection to the next worker in turn. A
+// worker runs its own epoll loop, and reads, evaluates and answers every
+// request of its connections itself, so a connection is only ever touched
+// by one thread. Evaluation runs inline on that loop: while one request
+// evaluates, the other connections of its worker wait, however long it
+// takes. Give the server at least as many workers as requests expected to
+// run at once.
+#define LSERVE_EVENTS 64
+#define LSERVE_READ 65536
+
+// Larger requests close the connection
+#define LSERVE_MAX_FRAME (64 << 20)
+
+typedef struct {
+  int fd;
+  interp_t *in;
+
+  // Bytes received and not yet evaluated, from roff on
+  lbuf rbuf;
+  size_t roff;
+
+  // Responses not yet sent, from woff on
+  lbuf wbuf;
+  size_t woff;
+
+  // What epoll watches the connection for
+  uint32_t events;
+
+  // Set once nothing more is read, because the peer has gone or a request
+  // was too large or called exit. The connection closes once what has
+  // been answered is sent.
+  int closing;
+} lconn;
+
+typedef struct {
+  int epfd;
+  const lbuf *prelude;
+} lworker;
+
+static void lconn_close(lworker *w, lconn *c) {
+  epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  if (c->in) { interp_del(c->in); }
+  lbuf_free(&c->rbuf);
+  lbuf_free(&c->wbuf);
+  free(c);
+}
+
+static uint32_t lserve_get_len(const char *p) {
+  const unsigned char *u = (const unsigned char*)p;
+  return ((uint32_t)u[0] << 24) | (u[1] << 16) | (u[2] << 8) | u[3];
+}
+
+static void lserve_put_len(char *p, uint32_t n) {
+  p[0] = n >> 24;
+  p[1] = n >> 16;
+  p[2] = n >> 8;
+  p[3] = n;
+}
+
+// Evaluates one request and appends the framed response to wbuf. Returns
+// non-zero if the request called exit, which closes the connection.
+static int lconn_eval(lworker *w, lconn *c, const char *s, size_t len) {
+  // The interpreter is restored from the prelude on first use
+  if (!c->in) {
+    c->in = interp_new();
+    lenv_deserialize(c->in->env, w->prelude->data, w->prelude->len);
+  }
+
+  size_t head = c->wbuf.len;
+  lbuf_put(&c->wbuf, "\0\0\0\0", 4);
+  c->in->out = &c->wbuf;
+  eval_buffer(c->in, "<request>", s, len);
+  c->in->out = NULL;
+  lserve_put_len(c->wbuf.data + head, c->wbuf.len - head - 4);
+  return interp_exited(c->in);
+}
+
+// Evaluates the request at roff if all of it has arrived. Returns 1 if
+// it was evaluated, 0 if it is still incomplete, and -1 if it is too
+// large or called exit, which closes the connection.
+static int lconn_request(lworker *w, lconn *c) {
+  if (c->rbuf.len - c->roff < 4) { return 0; }
+  uint32_t n = lserve_get_len(c->rbuf.data + c->roff);
+  if (n > LSERVE_MAX_FRAME) { return -1; }
+  if (c->rbuf.len - c->roff - 4 < n) { return 0; }
+
+  int exited = lconn_eval(w, c, c->rbuf.data + c->roff + 4, n);
+  c->roff += 4 + n;
+  if (c->roff == c->rbuf.len) {
+    c->rbuf.len = 0;
+    c->roff = 0;
+  }
+  return exited ? -1 : 1;
+}
+
+// Sends as much of wbuf as the socket takes. Returns non-zero on error.
+static int lconn_flush(lconn *c) {
+  while (c->woff < c->wbuf.len) {
+    ssize_t n = send(c->fd, c->wbuf.data + c->woff, c->wbuf.len - c->woff,
+      MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+      return 1;
+    }
+    c->woff += n;
+  }
+
+  if (c->woff == c->wbuf.len) {
+    c->wbuf.len = 0;
+    c->woff = 0;
+  }
+  return 0;
+}
+
+// Asks epoll about events, unless it already watches for them
+static void lconn_watch(lworker *w, lconn *c, uint32_t events) {
+  if (events == c->events) { return; }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = c;
+  epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  c->events = events;
+}
+
+// Answers the requests in rbuf one at a time. A response the peer hasn't
+// taken yet stops evaluation, and the connection then only waits to be
+// writable, so a peer that doesn't read can't make wbuf grow. Returns
+// non-zero once the connection should be closed.
+static int lconn_serve(lworker *w, lconn *c) {
+  for (;;) {
+    if (lconn_flush(c) != 0) { return 1; }
+    if (c->woff < c->wbuf.len) {
+      lconn_watch(w, c, EPOLLOUT);
+      return 0;
+    }
+
+    int r = lconn_request(w, c);
+    if (r < 0) {
+      // Nothing after it is answered, but its response is still sent
+      c->rbuf.len = 0;
+      c->roff = 0;
+      c->closing = 1;
+      continue;
+    }
+    if (r == 0) {
+      if (c->closing) { return 1; }
+      lconn_watch(w, c, EPOLLIN);
+      return 0;
+    }
+  }
+}
+
+// Reads until rbuf holds the whole request at its front, or nothing more
+// is available. The length in the header is checked before any of the
+// body is buffered, and epoll reports the rest of the input again once
+// the request has been answered. Returns non-zero once the peer has gone
+// or announced too large a request.
+static int lconn_read(lconn *c) {
+  // Drop the requests already answered
+  if (c->roff > 0) {
+    memmove(c->rbuf.data, c->rbuf.data + c->roff, c->rbuf.len - c->roff);
+    c->rbuf.len -= c->roff;
+    c->roff = 0;
+  }
+
+  for (;;) {
+    if (c->rbuf.len >= 4) {
+      uint32_t n = lserve_get_len(c->rbuf.data);
+      if (n > LSERVE_MAX_FRAME) { return 1; }
+      if (c->rbuf.len - 4 >= n) { return 0; }
+    }
+
+    lbuf_reserve(&c->rbuf, LSERVE_READ);
+    ssize_t n = read(c->fd, c->rbuf.data + c->rbuf.len,
+      c->rbuf.slots - c->rbuf.len);
+    if (n > 0) {
+      c->rbuf.len += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return 0; }
+    return 1;
+  }
+}
+
+static void* lworker_run(void *arg) {
+  lworker *w = arg;
+  struct epoll_event evs[LSERVE_EVENTS];
+
+  for (;;) {
+    int n = epoll_wait(w->epfd, evs, LSERVE_EVENTS, -1);
+    for (int i = 0; i < n; i++) {
+      lconn *c = evs[i].data.ptr;
+
+      // Whatever arrived before the peer hung up is still answered
+      if (!c->closing && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        c->closing = lconn_read(c);
+      }
+      if (lconn_serve(w, c) != 0) { lconn_close(w, c); }
+    }
+  }
+  return NULL;
+}
+
+// Opens a listening socket for a Unix socket path or host:port
+static int lserve_listen(const char *addr) {
+  const char *colon = strrchr(addr, ':');
+
+  if (!colon || strchr(addr, '/')) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(addr) >= sizeof(sun.sun_path)) { return -1; }
+    strcpy(sun.sun_path, addr);
+
+    // Replace a socket left by an earlier server, but nothing else
+    struct stat st;
+    if (lstat(addr, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+        errno = EADDRINUSE;
+        return -1;
+      }
+      unlink(addr);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) { return -1; }
+    if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // An empty host means localhost
+  char host[256];
+  size_t hn = colon - addr;
+  if (hn >= sizeof(host)) { return -1; }
+  memcpy(host, addr, hn);
+  host[hn] = '\0';
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(hn ? host : "127.0.0.1", colon + 1, &hints, &res) != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0) { continue; }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+int interp_serve(interp_t *in, const char *addr, int workers) {
+  int lfd = lserve_listen(addr);
+  if (lfd < 0) { return 1; }
+
+  // Connections start from the environment as it is now
+  lbuf *prelude = malloc(sizeof(lbuf));
+  lbuf_init(prelude);
+  lenv_serialize(in->env, prelude);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (workers < 1) { workers = 1; }
+  lworker *ws = malloc(sizeof(lworker) * workers);
+  for (int i = 0; i < workers; i++) {
+    ws[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+    ws[i].prelude = prelude;
+
+    pthread_t t;
+    if (ws[i].epfd < 0
+        || pthread_create(&t, NULL, lworker_run, &ws[i]) != 0) {
+      return 1;
+    }
+    pthread_detach(t);
+  }
+
+  for (int next = 0;;) {
+    int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) { continue; }
+      if (errno == EMFILE || errno == ENFILE) {
+        usleep(1000);
+        continue;
+      }
+      return 1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    lconn *c = malloc(sizeof(lconn));
+    c->fd = fd;
+    c->in = NULL;
+    lbuf_init(&c->rbuf);
+    c->roff = 0;
+    lbuf_init(&c->wbuf);
+    c->woff = 0;
+    c->events = EPOLLIN;
+    c->closing = 0;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(ws[next].epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    next = (next + 1) % workers;
+  }
+}
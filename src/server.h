@@ -0,0 +1,20 @@
+#ifndef server_h
+#define server_h
+
+#include "libparsing.h"
+
+// Serves framed requests on addr, a Unix socket path or host:port on TCP,
+// from a pool of worker threads. Every connection gets its own
+// interpreter, restored from a snapshot of in's global environment taken
+// when serving starts. Only returns if the socket could not be set up,
+// with non-zero.
+//
+// A frame is a four byte big endian length followed by that many bytes.
+// A request frame holds source text, and its response frame holds what
+// running it printed, one result per line as on the command line.
+//
+// Each worker evaluates the requests of its connections itself, one at a
+// time, so a slow request holds up the other connections of its worker.
+int interp_serve(interp_t *in, const char *addr, int workers);
+
+#endif